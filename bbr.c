@@ -0,0 +1,211 @@
+/* BBR style model based congestion control. Instead of reading loss as
+   congestion it estimates the bottleneck bandwidth (the best delivery
+   rate of recent round trips) and the minimum RTT, then paces at that
+   bandwidth and keeps about two bandwidth delay products in flight.
+   Random loss does not shrink the model, so a lossy link stays busy. */
+
+#include <stdlib.h>
+
+#include "congestion.h"
+#include "safeUtil.h"
+
+#define BBR_HIGH_GAIN 2.885         // 2/ln(2), doubles the rate every round
+#define BBR_CWND_GAIN 2.0
+#define BBR_MIN_CWND 4              // Packets, also the PROBE_RTT window
+#define BBR_FULL_BW_GROWTH 1.25     // STARTUP goes on while bandwidth grows this much a round
+#define BBR_FULL_BW_ROUNDS 3        // Rounds without that growth before leaving STARTUP
+#define BBR_MIN_RTT_WINDOW_US 10000000L // A min RTT older than this is probed again
+#define BBR_PROBE_RTT_US 200000L    // Time spent at BBR_MIN_CWND in PROBE_RTT
+// Rounds the bandwidth max filter looks back over
+#define BBR_BW_WINDOW_ROUNDS 10
+
+#define BBR_CYCLE_LENGTH 8
+static const double probe_bw_gains[BBR_CYCLE_LENGTH] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+typedef enum {
+    BBR_STARTUP,   // Double the rate every round until bandwidth stops growing
+    BBR_DRAIN,     // Empty the queue STARTUP built
+    BBR_PROBE_BW,  // Cycle the rate around the estimate
+    BBR_PROBE_RTT  // Shrink to a few packets so the queue empties and min RTT is seen again
+} BbrMode;
+
+/*Path model, kept in CongestionControl priv*/
+typedef struct {
+    BbrMode mode;
+    double bw_samples[BBR_BW_WINDOW_ROUNDS]; // Delivery rate of each recent round, packets per second
+    double btl_bw;         // Max of bw_samples, the bottleneck bandwidth estimate
+    long min_rtt_us;       // Smallest RTT seen in the min RTT window, -1 for none yet
+    long min_rtt_stamp_us; // When min_rtt_us was taken
+    long delivered;        // Packets acknowledged so far
+    long round_count;      // Round trips completed
+    int round_end;         // An RR at or past this sequence number ends the round
+    long round_delivered;  // delivered when the round started
+    long round_start_us;
+    double full_bw;        // Bandwidth STARTUP last saw grow by 25%
+    int full_bw_rounds;    // Rounds since it did
+    int cycle_index;       // Position in the PROBE_BW gain cycle
+    long probe_rtt_done_us; // When PROBE_RTT may end
+    double pacing_gain;
+    double cwnd_gain;
+    int after_timeout;     // cwnd stays at BBR_MIN_CWND until a round gives a fresh bandwidth sample
+} BbrState;
+
+static void bbr_init(CongestionControl *cc){
+    BbrState *bbr = (BbrState *)sCalloc(1, sizeof(BbrState));
+
+    cc->priv = bbr;
+    bbr->mode = BBR_STARTUP;
+    bbr->min_rtt_us = -1;
+    bbr->round_start_us = -1;
+    bbr->pacing_gain = BBR_HIGH_GAIN;
+    bbr->cwnd_gain = BBR_HIGH_GAIN;
+    cc->cwnd = CONGESTION_INITIAL_WINDOW;
+    cc->pacing_rate = 0; // Unpaced until the first round gives a bandwidth sample
+}
+
+/*Bandwidth delay product in packets, 0 until both are known*/
+static double bbr_bdp(const BbrState *bbr){
+    if (bbr->btl_bw <= 0 || bbr->min_rtt_us <= 0){
+        return 0;
+    }
+    return bbr->btl_bw * bbr->min_rtt_us / 1000000.0;
+}
+
+static void enter_probe_bw(BbrState *bbr){
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cycle_index = 2; // Start on a gain of 1, not straight into a probe
+    bbr->pacing_gain = probe_bw_gains[bbr->cycle_index];
+    bbr->cwnd_gain = BBR_CWND_GAIN;
+}
+
+/*Ends a round when the RR covers everything sent when it started and
+  files the round's delivery rate into the max filter.
+  Returns 1 if a round ended*/
+static int update_bandwidth(BbrState *bbr, const CongestionSignal *signal){
+    if (bbr->round_start_us < 0){
+        bbr->round_start_us = signal->now_us;
+        bbr->round_delivered = bbr->delivered;
+        bbr->round_end = signal->next_seq;
+        return 0;
+    }
+    if (signal->seq < bbr->round_end){
+        return 0;
+    }
+
+    long elapsed = signal->now_us - bbr->round_start_us;
+    if (elapsed > 0){
+        double sample = (bbr->delivered - bbr->round_delivered) * 1000000.0 / elapsed;
+        bbr->bw_samples[bbr->round_count % BBR_BW_WINDOW_ROUNDS] = sample;
+    }
+    bbr->round_count++;
+    bbr->bw_samples[bbr->round_count % BBR_BW_WINDOW_ROUNDS] = 0; // Slot about to be reused falls out
+
+    bbr->btl_bw = 0;
+    for (int i = 0; i < BBR_BW_WINDOW_ROUNDS; i++){
+        if (bbr->bw_samples[i] > bbr->btl_bw){
+            bbr->btl_bw = bbr->bw_samples[i];
+        }
+    }
+
+    bbr->round_start_us = signal->now_us;
+    bbr->round_delivered = bbr->delivered;
+    bbr->round_end = signal->next_seq;
+    return 1;
+}
+
+/*Moves between the modes once per round, or on the min RTT going stale*/
+static void update_mode(BbrState *bbr, const CongestionSignal *signal, int round_ended){
+    if (round_ended && bbr->mode == BBR_STARTUP){
+        if (bbr->btl_bw >= bbr->full_bw * BBR_FULL_BW_GROWTH){
+            bbr->full_bw = bbr->btl_bw;
+            bbr->full_bw_rounds = 0;
+        }else if (++bbr->full_bw_rounds >= BBR_FULL_BW_ROUNDS){
+            bbr->mode = BBR_DRAIN;
+            bbr->pacing_gain = 1.0 / BBR_HIGH_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+        }
+    }
+
+    if (bbr->mode == BBR_DRAIN && signal->in_flight - signal->acked <= bbr_bdp(bbr)){
+        enter_probe_bw(bbr);
+    }else if (round_ended && bbr->mode == BBR_PROBE_BW){
+        bbr->cycle_index = (bbr->cycle_index + 1) % BBR_CYCLE_LENGTH;
+        bbr->pacing_gain = probe_bw_gains[bbr->cycle_index];
+    }
+
+    if (bbr->mode != BBR_PROBE_RTT && bbr->mode != BBR_STARTUP && bbr->min_rtt_us > 0 &&
+        signal->now_us - bbr->min_rtt_stamp_us > BBR_MIN_RTT_WINDOW_US){
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->pacing_gain = 1.0;
+        bbr->probe_rtt_done_us = signal->now_us + BBR_PROBE_RTT_US;
+        bbr->min_rtt_stamp_us = signal->now_us; // The probe's samples set it afresh
+        bbr->min_rtt_us = -1;
+    }else if (bbr->mode == BBR_PROBE_RTT && signal->now_us >= bbr->probe_rtt_done_us && bbr->min_rtt_us > 0){
+        enter_probe_bw(bbr);
+    }
+}
+
+/*Turns the model into a pacing rate and a congestion window*/
+static void set_output(CongestionControl *cc){
+    BbrState *bbr = (BbrState *)cc->priv;
+
+    if (bbr->btl_bw > 0){
+        cc->pacing_rate = bbr->pacing_gain * bbr->btl_bw;
+    }
+
+    if (bbr->mode == BBR_PROBE_RTT || bbr->after_timeout){
+        cc->cwnd = BBR_MIN_CWND;
+        return;
+    }
+    double bdp = bbr_bdp(bbr);
+    if (bdp > 0){
+        int cwnd = (int)(bbr->cwnd_gain * bdp) + 1;
+        cc->cwnd = cwnd < BBR_MIN_CWND ? BBR_MIN_CWND : cwnd;
+    }
+    if (cc->cwnd > cc->receiver_window){
+        cc->cwnd = cc->receiver_window;
+    }
+}
+
+static void bbr_on_ack(CongestionControl *cc, const CongestionSignal *signal){
+    BbrState *bbr = (BbrState *)cc->priv;
+
+    if (signal->acked > 0){
+        bbr->delivered += signal->acked;
+        // Until there is a model, grow like slow start so the first rounds have samples
+        if (bbr->btl_bw <= 0){
+            cc->cwnd += signal->acked;
+        }
+    }
+
+    if (signal->rtt_us > 0 && (bbr->min_rtt_us < 0 || signal->rtt_us <= bbr->min_rtt_us)){
+        bbr->min_rtt_us = signal->rtt_us;
+        bbr->min_rtt_stamp_us = signal->now_us;
+    }
+
+    int round_ended = update_bandwidth(bbr, signal);
+    if (round_ended){
+        bbr->after_timeout = 0;
+    }
+    update_mode(bbr, signal, round_ended);
+    set_output(cc);
+}
+
+/*Loss alone says nothing about the bottleneck, BBR keeps its model.
+  A timeout does mean the path went quiet: the window drops to the
+  minimum and stays there until the next round measures the delivery
+  rate again, the pacing rate keeps the old estimate meanwhile*/
+static void bbr_on_timeout(CongestionControl *cc, const CongestionSignal *signal){
+    BbrState *bbr = (BbrState *)cc->priv;
+
+    bbr->round_start_us = -1;
+    bbr->after_timeout = 1;
+    cc->cwnd = BBR_MIN_CWND;
+}
+
+const CongestionOps congestion_bbr = {
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_timeout = bbr_on_timeout,
+};
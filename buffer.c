@@ -1,48 +1,255 @@
+#include <sys/mman.h>
+#include <stdatomic.h>
+
 #include "buffer.h"
 
-// Initialize the circular buffer
+// Huge page size tried for pool blocks when huge pages are on
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Chunks carved out of one pool block without huge pages
+#define POOL_BLOCK_CHUNKS 64
+
+/*Every thread takes chunks from a pool of its own, so threads mode
+  workers never contend for one. A session lives on a single thread,
+  its chunks go back to the pool they came from. Chunks freed as windows
+  slide go on the free list for the next buffer_reserve. Blocks are
+  never handed back and free chunks never move between threads, memory
+  follows the most data each thread ever had in flight at once*/
+typedef struct {
+    uint8_t *free_chunks;  // Free list, the link is stored in the chunk
+} ChunkPool;
+
+static __thread ChunkPool pool;
+
+// Bytes of blocks all pools together took from the system, the cap
+// covers every session in the process. Only touched when a pool grows
+static atomic_size_t allocated;
+static size_t memory_cap = BUFFER_DEFAULT_CAP; // 0 for no cap
+static bool huge_pages;
+
+// Back every pool block allocated after this call with huge pages when possible
+void buffer_set_huge_pages(bool enable) {
+    huge_pages = enable;
+}
+
+// Limit the bytes all window chunks together may use, 0 for no limit
+void buffer_set_memory_cap(size_t bytes) {
+    memory_cap = bytes;
+}
+
+// Largest window worth making a buffer for. Past the cap no more chunks
+// can be in flight, the extra slots would only grow the entry array
+int buffer_window_limit(void) {
+    if (memory_cap != 0 && memory_cap / BUFFER_CHUNK_STRIDE < BUFFER_MAX_WINDOW) {
+        return memory_cap / BUFFER_CHUNK_STRIDE > 0 ? memory_cap / BUFFER_CHUNK_STRIDE : 1;
+    }
+    return BUFFER_MAX_WINDOW;
+}
+
+// Allocate one block of len bytes, from huge pages if they were asked
+// for and the system has some, otherwise cache line aligned
+static uint8_t *alloc_block(size_t len) {
+    uint8_t *block = NULL;
+
+    if (huge_pages) {
+        block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block != MAP_FAILED) {
+            return block;
+        }
+    }
+
+    if (posix_memalign((void **)&block, BUFFER_CACHE_LINE, len) != 0) {
+        return NULL;
+    }
+
+    // No reserved huge pages, transparent ones are the next best thing
+    if (huge_pages) {
+        madvise(block, len, MADV_HUGEPAGE);
+    }
+    return block;
+}
+
+// Count len bytes against the cap, or fewer when near it.
+// Returns the bytes taken, 0 once the cap is reached
+static size_t take_allocation(size_t len) {
+    size_t before = atomic_load(&allocated);
+
+    do {
+        if (memory_cap != 0 && before + len > memory_cap) {
+            if (before >= memory_cap) {
+                return 0;
+            }
+            // Near the cap a smaller block may still fit
+            len = (memory_cap - before) / BUFFER_CHUNK_STRIDE * BUFFER_CHUNK_STRIDE;
+            if (len == 0) {
+                return 0;
+            }
+        }
+    } while (!atomic_compare_exchange_weak(&allocated, &before, before + len));
+    return len;
+}
+
+// Carve a new block into free chunks for this thread's pool.
+// Returns false once the cap is reached
+static bool grow_pool(void) {
+    size_t len = take_allocation(huge_pages ? HUGE_PAGE_SIZE : (size_t)POOL_BLOCK_CHUNKS * BUFFER_CHUNK_STRIDE);
+    if (len == 0) {
+        return false;
+    }
+
+    uint8_t *block = alloc_block(len);
+    if (block == NULL) {
+        atomic_fetch_sub(&allocated, len);
+        return false;
+    }
+
+    for (size_t offset = 0; offset + BUFFER_CHUNK_STRIDE <= len; offset += BUFFER_CHUNK_STRIDE) {
+        uint8_t *chunk = block + offset;
+        *(uint8_t **)chunk = pool.free_chunks;
+        pool.free_chunks = chunk;
+    }
+    return true;
+}
+
+static uint8_t *pool_get(void) {
+    if (pool.free_chunks == NULL && !grow_pool()) {
+        return NULL;
+    }
+    uint8_t *chunk = pool.free_chunks;
+    pool.free_chunks = *(uint8_t **)chunk;
+    return chunk;
+}
+
+static void pool_put(uint8_t *chunk) {
+    *(uint8_t **)chunk = pool.free_chunks;
+    pool.free_chunks = chunk;
+}
+
+// Initialize the circular buffer. No chunk memory is taken until a slot
+// is filled, and the entry array is only backed by pages once touched
 void buffer_init(CircularBuffer *buff, int window_size, int chunk_size, int highest) {
-    buff->entries = (BufferEntry *)malloc(window_size * sizeof(BufferEntry));
-    if (buff->entries == NULL) {
+    int slots = 1;
+    while (slots < window_size) {
+        slots <<= 1;
+    }
+
+    // Anonymous mappings start zeroed: no data, not valid
+    buff->entries_len = (size_t)slots * sizeof(BufferEntry);
+    buff->entries = mmap(NULL, buff->entries_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (buff->entries == MAP_FAILED) {
         perror("Memory Allocation Failure in Buffer Init");
         exit(1);
     }
 
-    buff->highest = highest; 
-    buff->lowest = 0;  
+    if (chunk_size > BUFFER_CHUNK_STRIDE) {
+        fprintf(stderr, "Buffer size %d is over the %d byte chunk limit\n", chunk_size, BUFFER_CHUNK_STRIDE);
+        exit(1);
+    }
+
+    buff->highest = highest;
+    buff->lowest = 0;
     buff->current = 0;  //Also known as expected for rcopy
     buff->size = window_size;
-    buff->buffer_size = chunk_size; 
-
-    // Allocate memory for each chunk and mark invalid
-    for (int i = 0; i < window_size; i++) {
-        buff->entries[i].data = (uint8_t *)malloc(chunk_size);
-        if (buff->entries[i].data == NULL) {
-            perror("Memory Allocation Failure for BufferEntry Data");
-            exit(1);
+    buff->buffer_size = chunk_size;
+    buff->slots = slots;
+    buff->mask = slots - 1;
+    buff->mapped = false;
+    buff->top = 0;
+}
+
+// Initialize a circular buffer whose entries will point into memory
+// owned by the caller (buffer_add_ref), the pool is never used
+void buffer_init_mapped(CircularBuffer *buff, int window_size, int chunk_size, int highest) {
+    buffer_init(buff, window_size, chunk_size, highest);
+    buff->mapped = true;
+}
+
+// Make sure the slot for sequence_num has a chunk and return it.
+// The slot is left invalid until the data is in.
+// Returns NULL when the memory cap is reached
+uint8_t *buffer_reserve(CircularBuffer *buff, int sequence_num) {
+    BufferEntry *entry = &buff->entries[buffer_index(buff, sequence_num)];
+
+    if (entry->data == NULL) {
+        entry->data = pool_get();
+        if (entry->data == NULL) {
+            return NULL;
         }
-        buff->entries[i].valid_flag = false;
-        buff->entries[i].sequence_num = -1;
     }
+    entry->valid_flag = false;
+    entry->sequence_num = sequence_num;
+    entry->resent_us = 0;
+    if (sequence_num >= buff->top) {
+        buff->top = sequence_num + 1;
+    }
+    return entry->data;
 }
 
-// Add a data chunk to the buffer
-void buffer_add(CircularBuffer *buff, int sequence_num, uint8_t *data, int data_size) {
-    int index = sequence_num % buff->size;  // Circular index calculation
+// Add a data chunk to the buffer.
+// Returns false, leaving the slot empty, when the memory cap is reached
+bool buffer_add(CircularBuffer *buff, int sequence_num, uint8_t *data, int data_size) {
+    int index = buffer_index(buff, sequence_num);
 
     // Store the data chunk
-    memset(buff->entries[index].data, 0, buff->buffer_size);
+    if (buffer_reserve(buff, sequence_num) == NULL) {
+        return false;
+    }
     memcpy(buff->entries[index].data, data, data_size);
+    buff->entries[index].valid_flag = 1;
+    buff->entries[index].data_len = data_size;
+    return true;
+}
+
+// Point an entry at a chunk without copying it, for mapped buffers
+void buffer_add_ref(CircularBuffer *buff, int sequence_num, uint8_t *data, int data_size) {
+    int index = buffer_index(buff, sequence_num);
+
+    buff->entries[index].data = data;
     buff->entries[index].sequence_num = sequence_num;
     buff->entries[index].valid_flag = 1;
-    buff->entries[index].data_len = data_size; 
+    buff->entries[index].data_len = data_size;
+    buff->entries[index].resent_us = 0;
+}
+
+// Record that sequence_num arrived without keeping its data, for a
+// receiver that already wrote the chunk to its place in the file
+void buffer_mark(CircularBuffer *buff, int sequence_num, int data_size) {
+    BufferEntry *entry = &buff->entries[buffer_index(buff, sequence_num)];
+
+    if (!buff->mapped && entry->data != NULL) {
+        pool_put(entry->data);
+    }
+    entry->data = NULL;
+    entry->sequence_num = sequence_num;
+    entry->valid_flag = 1;
+    entry->data_len = data_size;
+    entry->resent_us = 0;
+    if (sequence_num >= buff->top) {
+        buff->top = sequence_num + 1;
+    }
+}
+
+// Give the chunk of sequence_num back to the pool once it is no longer needed
+void buffer_release(CircularBuffer *buff, int sequence_num) {
+    BufferEntry *entry = &buff->entries[buffer_index(buff, sequence_num)];
+
+    if (entry->sequence_num != sequence_num) {
+        return;
+    }
+    entry->valid_flag = false;
+    if (!buff->mapped && entry->data != NULL) {
+        pool_put(entry->data);
+    }
+    entry->data = NULL;
 }
 
 // Free dynamically allocated memory
 void buffer_free(CircularBuffer *buff) {
-    for (int i = 0; i < buff->size; i++) {
-        free(buff->entries[i].data);
+    // Chunks can only be held by the last slots worth of reserved
+    // sequence numbers, the rest of a huge entry array is never touched
+    int first = buff->top > buff->slots ? buff->top - buff->slots : 0;
+    for (int seq = first; seq < buff->top && !buff->mapped; seq++) {
+        buffer_release(buff, seq);
     }
-    free(buff->entries);
-    free(buff); 
+    munmap(buff->entries, buff->entries_len);
+    free(buff);
 }
@@ -7,24 +7,53 @@
 #include <stdint.h>
 #include <string.h>
 
+// Chunks start on cache line boundaries
+#define BUFFER_CACHE_LINE 64
+// Every chunk holds up to a full payload (1400) rounded up to a cache line
+#define BUFFER_CHUNK_STRIDE 1408
+// Default limit on the bytes all window chunks in the process may use
+#define BUFFER_DEFAULT_CAP ((size_t)256 * 1024 * 1024)
+// Largest window a buffer is made for when there is no cap
+#define BUFFER_MAX_WINDOW (1 << 20)
+
 typedef struct {
-    uint8_t *data;    // Will be set by buffer-size
+    uint8_t *data;    // Chunk from the pool, NULL until the slot is first filled
     int sequence_num; // Packet sequence number
     bool valid_flag;  // If the chunk is stored in the buffer
     int data_len;      // length of data
+    uint8_t header[8]; // Server only: the 7 byte packet header as last sent
+    long resent_us;    // Server only: rtt_now_us() of the last SACK driven resend, 0 for none
 } BufferEntry;
 
 typedef struct {
-    BufferEntry *entries;
+    BufferEntry *entries; // slots of them, kept apart from the payloads
     int highest;  // Highest sent sequence number
     int lowest;   // Lowest unacknowledged sequence number
     int current;  // Next sequence number that can be sent
-    int size;     // Window size 
-    int buffer_size; //Buffer Size 
+    int size;     // Window size
+    int buffer_size; //Buffer Size
+    bool mapped;     // Entry data points into a file mapping owned by someone else
+    int slots;       // Window size rounded up to a power of two
+    int mask;        // slots - 1, see buffer_index
+    int top;         // One past the highest sequence number ever reserved
+    size_t entries_len;
 } CircularBuffer;
 
+// Slot of a sequence number, replaces sequence_num % size
+static inline int buffer_index(const CircularBuffer *buff, int sequence_num) {
+    return sequence_num & buff->mask;
+}
+
+void buffer_set_huge_pages(bool enable);
+void buffer_set_memory_cap(size_t bytes);
+int buffer_window_limit(void);
 void buffer_init(CircularBuffer *buff, int window_size, int chunk_size, int highest);
-void buffer_add(CircularBuffer *buff, int sequence_num, uint8_t *data, int data_size);
+void buffer_init_mapped(CircularBuffer *buff, int window_size, int chunk_size, int highest);
+uint8_t *buffer_reserve(CircularBuffer *buff, int sequence_num);
+bool buffer_add(CircularBuffer *buff, int sequence_num, uint8_t *data, int data_size);
+void buffer_add_ref(CircularBuffer *buff, int sequence_num, uint8_t *data, int data_size);
+void buffer_mark(CircularBuffer *buff, int sequence_num, int data_size);
+void buffer_release(CircularBuffer *buff, int sequence_num);
 void buffer_free(CircularBuffer *buff);
 
-#endif
\ No newline at end of file
+#endif
@@ -5,7 +5,7 @@ BUILD_MINOR=21
 TEST=test
 
 CC = g++
-CFLAGS = -std=c++11
+CFLAGS = -std=c++11 -O2
 
 LIBPATH=libcpe464
 NETWORK=libcpe464/networks
@@ -2,7 +2,11 @@
  * shadows@whitefang.com
  */
 
+#include <stdint.h>
+
 unsigned short in_cksum(unsigned short *addr,int len);
+uint64_t cksum_accumulate(void *dst, const void *src, int len);
+unsigned short cksum_fold(uint64_t sum);
 
 
 
@@ -0,0 +1,372 @@
+/* Per-chunk payload checksums of a served file, kept in a sidecar next
+   to it. The Internet checksum is linear, so a packet's checksum is the
+   7 byte header's sum plus the stored payload sum and the payload never
+   has to be summed at send time. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checksumIndex.h"
+#include "communication.h"
+#include "safeUtil.h"
+
+// Buffer sizes a sidecar has sections for
+static const int index_sizes[] = {100, 500, 512, 700, 1000, 1024, 1400};
+#define INDEX_SIZE_COUNT (int)(sizeof(index_sizes) / sizeof(index_sizes[0]))
+
+// Sidecar images loaded in this process, newest first
+static CksumIndexFile *loaded = NULL;
+static pthread_mutex_t loaded_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_indexed_size(int buffer_size){
+    for (int i = 0; i < INDEX_SIZE_COUNT; i++){
+        if (index_sizes[i] == buffer_size){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t chunk_count_for(uint64_t file_size, int buffer_size){
+    return (uint32_t)((file_size + buffer_size - 1) / buffer_size);
+}
+
+/*True when a sidecar image was built from this version of the file*/
+static int image_matches(const uint8_t *image, size_t len, const struct stat *info){
+    CksumIndexHeader header;
+
+    if (len < sizeof(header)){
+        return 0;
+    }
+    memcpy(&header, image, sizeof(header));
+    return header.magic == CKSUM_INDEX_MAGIC && header.file_size == (uint64_t)info->st_size &&
+           header.mtime_sec == (int64_t)info->st_mtim.tv_sec && header.mtime_nsec == (int64_t)info->st_mtim.tv_nsec;
+}
+
+/*Finds the section for buffer_size in a sidecar image image_matches
+  accepted. The index points into the image, nothing is copied.
+  Returns NULL if the image is damaged or has no such section*/
+static CksumIndex *parse_index(uint8_t *image, size_t len, int buffer_size){
+    CksumIndexHeader header;
+    memcpy(&header, image, sizeof(header));
+
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.section_count; i++){
+        CksumIndexSection section;
+        if (len - offset < sizeof(section)){
+            return NULL;
+        }
+        memcpy(&section, image + offset, sizeof(section));
+        offset += sizeof(section);
+
+        size_t sums_len = (size_t)section.chunk_count * sizeof(uint16_t);
+        if (len - offset < sums_len){
+            return NULL;
+        }
+        if ((int)section.buffer_size == buffer_size && section.chunk_count == chunk_count_for(header.file_size, buffer_size)){
+            CksumIndex *index = (CksumIndex *)sCalloc(1, sizeof(CksumIndex));
+            index->chunk_count = section.chunk_count;
+            // Header and sections are a multiple of 2 bytes long, the sums stay aligned
+            index->sums = (uint16_t *)(image + offset);
+            return index;
+        }
+        offset += sums_len;
+    }
+    return NULL;
+}
+
+/*Reads the whole sidecar at path into memory. Returns NULL if there is none*/
+static uint8_t *read_sidecar(const char *path, size_t *len){
+    FILE *sidecar = fopen(path, "rb");
+    if (sidecar == NULL){
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fileno(sidecar), &info) < 0 || info.st_size <= 0){
+        fclose(sidecar);
+        return NULL;
+    }
+
+    uint8_t *image = (uint8_t *)sCalloc(1, info.st_size);
+    *len = fread(image, 1, info.st_size, sidecar);
+    fclose(sidecar);
+    return image;
+}
+
+/*Sums every chunk of the file for every indexed buffer size into a
+  sidecar image. Returns NULL if the file can't be mapped*/
+static uint8_t *build_image(int fd, const struct stat *info, size_t *len){
+    uint64_t file_size = info->st_size;
+    uint8_t *data = NULL;
+
+    if (file_size > 0){
+        data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED){
+            perror("mmap for checksum index");
+            return NULL;
+        }
+        madvise(data, file_size, MADV_SEQUENTIAL);
+    }
+
+    *len = sizeof(CksumIndexHeader);
+    for (int i = 0; i < INDEX_SIZE_COUNT; i++){
+        *len += sizeof(CksumIndexSection) + chunk_count_for(file_size, index_sizes[i]) * sizeof(uint16_t);
+    }
+    uint8_t *image = (uint8_t *)sCalloc(1, *len);
+
+    CksumIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CKSUM_INDEX_MAGIC;
+    header.section_count = INDEX_SIZE_COUNT;
+    header.file_size = file_size;
+    header.mtime_sec = info->st_mtim.tv_sec;
+    header.mtime_nsec = info->st_mtim.tv_nsec;
+    memcpy(image, &header, sizeof(header));
+
+    size_t offset = sizeof(header);
+    for (int i = 0; i < INDEX_SIZE_COUNT; i++){
+        CksumIndexSection section;
+        section.buffer_size = index_sizes[i];
+        section.chunk_count = chunk_count_for(file_size, index_sizes[i]);
+        memcpy(image + offset, &section, sizeof(section));
+        offset += sizeof(section);
+
+        for (uint32_t chunk = 0; chunk < section.chunk_count; chunk++){
+            uint64_t start = (uint64_t)chunk * section.buffer_size;
+            int chunk_len = section.buffer_size;
+            if (file_size - start < (uint64_t)chunk_len){
+                chunk_len = file_size - start;
+            }
+            uint16_t sum = cksum_fold(cksum_accumulate(NULL, data + start, chunk_len));
+            memcpy(image + offset, &sum, sizeof(sum));
+            offset += sizeof(sum);
+        }
+    }
+
+    if (data != NULL){
+        munmap(data, file_size);
+    }
+    return image;
+}
+
+/*Writes the image next to the file. The rename makes it appear whole,
+  a reader never sees half a sidecar. mkstemp gives every writer its
+  own temporary, threads of one server included. Failing is fine, the
+  caller still has the image in memory*/
+static void write_sidecar(const char *path, const uint8_t *image, size_t len){
+    char temp_path[MAX_FILENAME_SIZE + 64];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0){
+        perror("Checksum index not saved");
+        return;
+    }
+    fchmod(fd, 0644);
+    FILE *sidecar = fdopen(fd, "wb");
+    if (sidecar == NULL){
+        perror("Checksum index not saved");
+        close(fd);
+        unlink(temp_path);
+        return;
+    }
+    size_t written = fwrite(image, 1, len, sidecar);
+    if (fclose(sidecar) != 0 || written != len || rename(temp_path, path) < 0){
+        perror("Checksum index not saved");
+        unlink(temp_path);
+    }
+}
+
+/*Looks up the loaded image of a file version, NULL if there is none.
+  Caller holds loaded_lock*/
+static CksumIndexFile *find_loaded(const struct stat *info){
+    for (CksumIndexFile *file = loaded; file != NULL; file = file->next){
+        if (file->dev == info->st_dev && file->ino == info->st_ino && file->size == info->st_size &&
+            file->mtime.tv_sec == info->st_mtim.tv_sec && file->mtime.tv_nsec == info->st_mtim.tv_nsec){
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/*Adds an entry for a file version whose image is still to be read or
+  built. Past CKSUM_INDEX_KEEP entries the oldest one no session uses is
+  dropped, which is also how images of replaced file versions go.
+  Caller holds loaded_lock*/
+static CksumIndexFile *add_loaded(const struct stat *info){
+    CksumIndexFile *file = (CksumIndexFile *)sCalloc(1, sizeof(CksumIndexFile));
+    file->dev = info->st_dev;
+    file->ino = info->st_ino;
+    file->size = info->st_size;
+    file->mtime = info->st_mtim;
+    file->image = NULL;
+    file->refs = 0;
+    file->next = loaded;
+    loaded = file;
+
+    int count = 0;
+    CksumIndexFile **oldest = NULL;
+    for (CksumIndexFile **link = &loaded; *link != NULL; link = &(*link)->next){
+        count++;
+        if ((*link)->refs == 0 && (*link)->image != NULL){
+            oldest = link;
+        }
+    }
+    if (count > CKSUM_INDEX_KEEP && oldest != NULL){
+        CksumIndexFile *victim = *oldest;
+        *oldest = victim->next;
+        free(victim->image);
+        free(victim);
+    }
+    return file;
+}
+
+/*Takes an entry whose image could not be had back out, so a later
+  session tries again. Caller holds loaded_lock*/
+static void remove_loaded(CksumIndexFile *file){
+    for (CksumIndexFile **link = &loaded; *link != NULL; link = &(*link)->next){
+        if (*link == file){
+            *link = file->next;
+            break;
+        }
+    }
+    free(file->image);
+    free(file);
+}
+
+/*Publishes a read or built image, sessions opening the file from now on
+  take their index from it*/
+static void set_image(CksumIndexFile *file, uint8_t *image, size_t len){
+    pthread_mutex_lock(&loaded_lock);
+    file->len = len;
+    file->image = image;
+    pthread_mutex_unlock(&loaded_lock);
+}
+
+/*Builds, saves and publishes the sidecar of a file*/
+static void build_sidecar(CksumIndexFile *file, int fd, const struct stat *info, const char *path){
+    size_t len = 0;
+
+    printf("Building checksum index %s\n", path);
+    uint8_t *image = build_image(fd, info, &len);
+    if (image == NULL){
+        pthread_mutex_lock(&loaded_lock);
+        remove_loaded(file);
+        pthread_mutex_unlock(&loaded_lock);
+        return;
+    }
+    write_sidecar(path, image, len);
+    set_image(file, image, len);
+}
+
+/*What a helper thread building a sidecar needs*/
+typedef struct {
+    CksumIndexFile *file;
+    int fd;                 // Its own descriptor, the session may close the file first
+    struct stat info;
+    char path[MAX_FILENAME_SIZE + 16];
+} BuildJob;
+
+static void *build_thread(void *arg){
+    BuildJob *job = (BuildJob *)arg;
+
+    build_sidecar(job->file, job->fd, &job->info, job->path);
+    close(job->fd);
+    free(job);
+    return NULL;
+}
+
+/*Starts a detached helper thread on the build. Returns 0 if it can't*/
+static int start_build(CksumIndexFile *file, FILE *source, const struct stat *info, const char *path){
+    BuildJob *job = (BuildJob *)sCalloc(1, sizeof(BuildJob));
+    job->file = file;
+    job->info = *info;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    if ((job->fd = dup(fileno(source))) < 0){
+        perror("dup for checksum index");
+        free(job);
+        return 0;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int error = pthread_create(&thread, &attr, build_thread, job);
+    pthread_attr_destroy(&attr);
+    if (error != 0){
+        fprintf(stderr, "Checksum index thread: %s\n", strerror(error));
+        close(job->fd);
+        free(job);
+        return 0;
+    }
+    return 1;
+}
+
+/*Returns the payload sums of an open file for one buffer size, from
+  its sidecar. Each version of a file is read and parsed once per
+  process, every session serving it shares the loaded image.
+  A missing or stale sidecar is rebuilt first, or with in_background by
+  a helper thread while this session sums its payloads as it sends.
+  Sessions opening the file during the build do the same.
+  Returns NULL when buffer_size is not one the index covers, or the
+  index is not there yet*/
+CksumIndex *cksum_index_open(const char *filename, FILE *file, int buffer_size, int in_background){
+    struct stat info;
+    char path[MAX_FILENAME_SIZE + 16];
+    size_t len = 0;
+
+    if (!is_indexed_size(buffer_size) || fstat(fileno(file), &info) < 0){
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s%s", filename, CKSUM_INDEX_SUFFIX);
+
+    pthread_mutex_lock(&loaded_lock);
+    CksumIndexFile *loaded_file = find_loaded(&info);
+    if (loaded_file != NULL){
+        CksumIndex *index = NULL;
+        if (loaded_file->image != NULL && (index = parse_index(loaded_file->image, loaded_file->len, buffer_size)) != NULL){
+            index->file = loaded_file;
+            loaded_file->refs++;
+        }
+        pthread_mutex_unlock(&loaded_lock);
+        return index; // NULL while another session reads or builds it
+    }
+    loaded_file = add_loaded(&info);
+    pthread_mutex_unlock(&loaded_lock);
+
+    uint8_t *image = read_sidecar(path, &len);
+    if (image != NULL && image_matches(image, len, &info)){
+        set_image(loaded_file, image, len);
+    }else{
+        free(image);
+        if (in_background && start_build(loaded_file, file, &info, path)){
+            return NULL;
+        }
+        build_sidecar(loaded_file, fileno(file), &info, path);
+    }
+
+    pthread_mutex_lock(&loaded_lock);
+    CksumIndex *index = NULL;
+    loaded_file = find_loaded(&info);
+    if (loaded_file != NULL && loaded_file->image != NULL &&
+        (index = parse_index(loaded_file->image, loaded_file->len, buffer_size)) != NULL){
+        index->file = loaded_file;
+        loaded_file->refs++;
+    }
+    pthread_mutex_unlock(&loaded_lock);
+    return index;
+}
+
+/*Hands the index back. The loaded image stays for the next session*/
+void cksum_index_free(CksumIndex *index){
+    pthread_mutex_lock(&loaded_lock);
+    index->file->refs--;
+    pthread_mutex_unlock(&loaded_lock);
+    free(index);
+}
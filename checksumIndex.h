@@ -0,0 +1,59 @@
+#ifndef CHECKSUM_INDEX_H
+#define CHECKSUM_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Appended to the served file's name to get its sidecar
+#define CKSUM_INDEX_SUFFIX ".cksum"
+// "CSK1" written in native byte order, a sidecar from a machine of the
+// other byte order fails this check and gets rebuilt
+#define CKSUM_INDEX_MAGIC 0x43534b31
+// Loaded sidecar images kept once no session uses them
+#define CKSUM_INDEX_KEEP 16
+
+/*Sidecar layout: a CksumIndexHeader, then section_count sections.
+  Each section is a CksumIndexSection followed by chunk_count uint16_t
+  payload sums, chunk i covering file bytes [i * buffer_size, (i + 1) * buffer_size).
+  A sum is the folded, not inverted, ones complement sum in_cksum would
+  add up for that chunk, ready for finish_checksum style combining.
+  The file's size and mtime are stored so a changed file is noticed*/
+typedef struct {
+    uint32_t magic;
+    uint32_t section_count;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} CksumIndexHeader;
+
+typedef struct {
+    uint32_t buffer_size;
+    uint32_t chunk_count;
+} CksumIndexSection;
+
+/*A sidecar image loaded for one version of a file, shared by every
+  session in the process that serves it*/
+typedef struct CksumIndexFile {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint8_t *image;       // NULL while it is being read or built
+    size_t len;
+    int refs;             // Open CksumIndexes pointing into image
+    struct CksumIndexFile *next;
+} CksumIndexFile;
+
+/*Payload sums of one file for one buffer size*/
+typedef struct {
+    uint16_t *sums;       // Points into file->image
+    int chunk_count;
+    CksumIndexFile *file;
+} CksumIndex;
+
+CksumIndex *cksum_index_open(const char *filename, FILE *file, int buffer_size, int in_background);
+void cksum_index_free(CksumIndex *index);
+
+#endif
@@ -0,0 +1,196 @@
+/* Chunks of served files shared by every session on the server. Ten
+   clients fetching the same hot file read it from disk once, the other
+   sessions copy each chunk out of the cache into their window. Entries
+   are replaced with the CLOCK approximation of LRU inside a fixed
+   memory budget. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chunkCache.h"
+
+static size_t align_up(size_t len, size_t to){
+    return (len + to - 1) / to * to;
+}
+
+/*Takes the lock, repairing it if its holder died with it*/
+static void cache_lock(ChunkCache *cache){
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD){
+        // The dead holder may have left an entry half linked, start over
+        memset(cache->heads, 0xff, cache->buckets * sizeof(int));
+        memset(cache->entries, 0, cache->slots * sizeof(ChunkCacheEntry));
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+/*Makes a cache of about bytes of shared memory.
+  Returns NULL when bytes is too small for a single chunk*/
+ChunkCache *chunk_cache_create(size_t bytes){
+    int slots = bytes / (CHUNK_CACHE_STRIDE + sizeof(ChunkCacheEntry) + 2 * sizeof(int));
+    if (slots < 1){
+        return NULL;
+    }
+    int buckets = 1;
+    while (buckets < slots){
+        buckets <<= 1;
+    }
+
+    size_t heads_at = align_up(sizeof(ChunkCache), 64);
+    size_t entries_at = align_up(heads_at + buckets * sizeof(int), 64);
+    size_t data_at = align_up(entries_at + slots * sizeof(ChunkCacheEntry), 64);
+    size_t map_len = data_at + (size_t)slots * CHUNK_CACHE_STRIDE;
+
+    uint8_t *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED){
+        perror("mmap chunk cache");
+        exit(-1);
+    }
+
+    ChunkCache *cache = (ChunkCache *)map;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cache->slots = slots;
+    cache->buckets = buckets;
+    cache->hand = 0;
+    cache->map_len = map_len;
+    cache->heads = (int *)(map + heads_at);
+    cache->entries = (ChunkCacheEntry *)(map + entries_at);
+    cache->data = map + data_at;
+    cache->hits = 0;
+    cache->misses = 0;
+    memset(cache->heads, 0xff, buckets * sizeof(int)); // Every chain -1
+    return cache;
+}
+
+/*Fills id for an open file. Returns 0 if it can't be stat'd*/
+int chunk_cache_file_id(int fd, ChunkFileId *id){
+    struct stat info;
+
+    if (fstat(fd, &info) < 0){
+        perror("fstat");
+        return 0;
+    }
+    memset(id, 0, sizeof(ChunkFileId));
+    id->dev = info.st_dev;
+    id->ino = info.st_ino;
+    id->size = info.st_size;
+    id->mtime_ns = info.st_mtim.tv_sec * 1000000000L + info.st_mtim.tv_nsec;
+    return 1;
+}
+
+static int bucket_of(const ChunkCache *cache, const ChunkFileId *file, long offset, int chunk_size){
+    uint64_t hash = (uint64_t)file->ino * 0x9e3779b97f4a7c15ULL;
+    hash ^= (uint64_t)file->dev + 0x632be59bd9b4e019ULL + (hash << 6) + (hash >> 2);
+    hash ^= (uint64_t)(offset / chunk_size) * 0xbf58476d1ce4e5b9ULL;
+    hash ^= (uint64_t)chunk_size << 40;
+    hash ^= hash >> 31;
+    return hash & (cache->buckets - 1);
+}
+
+static int same_chunk(const ChunkCacheEntry *entry, const ChunkFileId *file, long offset, int chunk_size){
+    return entry->offset == offset && entry->chunk_size == chunk_size &&
+           entry->file.ino == file->ino && entry->file.dev == file->dev &&
+           entry->file.size == file->size && entry->file.mtime_ns == file->mtime_ns;
+}
+
+static int find_entry(ChunkCache *cache, int bucket, const ChunkFileId *file, long offset, int chunk_size){
+    for (int i = cache->heads[bucket]; i >= 0; i = cache->entries[i].next){
+        if (same_chunk(&cache->entries[i], file, offset, chunk_size)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*Copies a cached chunk into out.
+  Returns its length, or -1 when it isn't cached*/
+int chunk_cache_get(ChunkCache *cache, const ChunkFileId *file, long offset, int chunk_size, uint8_t *out){
+    int len = -1;
+
+    cache_lock(cache);
+    int i = find_entry(cache, bucket_of(cache, file, offset, chunk_size), file, offset, chunk_size);
+    if (i >= 0){
+        ChunkCacheEntry *entry = &cache->entries[i];
+        entry->referenced = 1;
+        len = entry->len;
+        memcpy(out, cache->data + (size_t)i * CHUNK_CACHE_STRIDE, len);
+        cache->hits++;
+    }else{
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return len;
+}
+
+/*Takes an entry out of its hash chain*/
+static void unlink_entry(ChunkCache *cache, int victim){
+    ChunkCacheEntry *entry = &cache->entries[victim];
+    int *link = &cache->heads[bucket_of(cache, &entry->file, entry->offset, entry->chunk_size)];
+
+    while (*link >= 0 && *link != victim){
+        link = &cache->entries[*link].next;
+    }
+    if (*link == victim){
+        *link = entry->next;
+    }
+    entry->used = 0;
+}
+
+/*Sweeps the clock hand to an entry that can be reused: an empty one,
+  or one not read since the hand last went by*/
+static int evict(ChunkCache *cache){
+    for (;;){
+        int i = cache->hand;
+        ChunkCacheEntry *entry = &cache->entries[i];
+        cache->hand = (cache->hand + 1) % cache->slots;
+
+        if (!entry->used){
+            return i;
+        }
+        if (entry->referenced){
+            entry->referenced = 0;
+            continue;
+        }
+        unlink_entry(cache, i);
+        return i;
+    }
+}
+
+/*Stores a chunk just read from the file. Another session may have
+  stored it meanwhile, then the copy in the cache is kept*/
+void chunk_cache_put(ChunkCache *cache, const ChunkFileId *file, long offset, int chunk_size, const uint8_t *data, int len){
+    if (len <= 0 || len > CHUNK_CACHE_STRIDE){
+        return;
+    }
+
+    cache_lock(cache);
+    int bucket = bucket_of(cache, file, offset, chunk_size);
+    if (find_entry(cache, bucket, file, offset, chunk_size) < 0){
+        int i = evict(cache);
+        ChunkCacheEntry *entry = &cache->entries[i];
+        entry->file = *file;
+        entry->offset = offset;
+        entry->chunk_size = chunk_size;
+        entry->len = len;
+        entry->used = 1;
+        entry->referenced = 0;
+        memcpy(cache->data + (size_t)i * CHUNK_CACHE_STRIDE, data, len);
+        entry->next = cache->heads[bucket];
+        cache->heads[bucket] = i;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void chunk_cache_free(ChunkCache *cache){
+    pthread_mutex_destroy(&cache->lock);
+    munmap(cache, cache->map_len);
+}
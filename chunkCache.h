@@ -0,0 +1,56 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "buffer.h"
+
+// Default memory budget in MB, 0 turns the cache off
+#define CHUNK_CACHE_DEFAULT_MB 64
+// Bytes kept for every cached chunk, the same slot a window chunk gets
+#define CHUNK_CACHE_STRIDE BUFFER_CHUNK_STRIDE
+
+/*Which version of which file a chunk came from. A file rewritten in
+  place gets a new mtime or size, so its old chunks are never served*/
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    long mtime_ns;
+} ChunkFileId;
+
+typedef struct {
+    ChunkFileId file;
+    long offset;          // Byte offset of the chunk in the file
+    int chunk_size;       // Buffer size the chunk was read for
+    int len;              // Bytes held, less than chunk_size only at the end of the file
+    int next;             // Next entry in the same hash bucket, -1 ends the chain
+    uint8_t used;         // Holds a chunk
+    uint8_t referenced;   // Read since the clock hand last passed, spares it once
+} ChunkCacheEntry;
+
+/*Lives at the start of a MAP_SHARED mapping made before the server
+  forks or starts threads, so every session of every child and worker
+  sees the same chunks. The pointers are valid in all of them because
+  the mapping is inherited at the same address*/
+typedef struct {
+    pthread_mutex_t lock; // Process shared and robust, a killed child can't wedge it
+    int slots;
+    int buckets;          // Power of two
+    int hand;             // Clock hand, the next entry eviction looks at
+    size_t map_len;
+    int *heads;           // buckets chain heads, -1 when empty
+    ChunkCacheEntry *entries;
+    uint8_t *data;        // slots chunks of CHUNK_CACHE_STRIDE bytes
+    long hits;
+    long misses;
+} ChunkCache;
+
+ChunkCache *chunk_cache_create(size_t bytes);
+int chunk_cache_file_id(int fd, ChunkFileId *id);
+int chunk_cache_get(ChunkCache *cache, const ChunkFileId *file, long offset, int chunk_size, uint8_t *out);
+void chunk_cache_put(ChunkCache *cache, const ChunkFileId *file, long offset, int chunk_size, const uint8_t *data, int len);
+void chunk_cache_free(ChunkCache *cache);
+
+#endif
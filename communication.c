@@ -1,31 +1,99 @@
 #include "communication.h"
 
-/*This Function is for building packets
-  For building headers, set payload to NULL and payload_size to 0*/
-  int build_packet(uint8_t *packet, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size){
-    memset(packet, 0, 7 + payload_size); // Zero out the packet
-    int packet_len = 0;
+/*Fills in the checksum of a 7 byte header (checksum field zeroed)
+  followed by a payload whose folded sum is payload_sum*/
+static void finish_checksum(uint8_t *header, uint32_t payload_sum){
+    uint16_t word;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < 6; i += 2){
+        memcpy(&word, header + i, 2);
+        sum += word;
+    }
+    word = 0;
+    *(uint8_t *)&word = header[6];
+    sum += word;
+
+    // The payload starts on an odd byte so its words land byte swapped
+    sum += ((payload_sum & 0xff) << 8) | (payload_sum >> 8);
+
+    uint16_t checksum = ~cksum_fold(sum);
+    memcpy(header + 4, &checksum, 2);
+}
 
-    // Set sequence number (bytes 0-3)
+/*Writes the sequence number and flag, checksum field zeroed*/
+static void write_header(uint8_t *header, uint32_t seq_num, uint8_t flag){
     uint32_t net_seq_num = htonl(seq_num);
-    memcpy(packet, &net_seq_num, 4);
+    memcpy(header, &net_seq_num, 4);
+    memset(header + 4, 0, 2);
+    header[6] = flag;
+}
+
+/*This Function is for building packets
+  For building headers, set payload to NULL and payload_size to 0.
+  The payload is copied and summed in the same pass by the checksum
+  library, so its bytes are only read once*/
+int build_packet(uint8_t *packet, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size){
+    uint32_t payload_sum = 0;
 
-    // Set flag (byte 6)
-    packet[6] = flag;
+    write_header(packet, seq_num, flag);
 
     // Copy payload if provided
-    if (payload != NULL && payload_size > 0)
-    {
-        memcpy(packet + 7, payload, payload_size);
-        packet_len = HEADER_SIZE + payload_size;
+    if (payload != NULL && payload_size > 0){
+        payload_sum = cksum_fold(cksum_accumulate(packet + HEADER_SIZE, payload, payload_size));
     }else{
-        packet_len = HEADER_SIZE;
+        payload_size = 0;
     }
 
     // Compute checksum (bytes 4-5)
-    memset(packet + 4, 0, 2); // Reset checksum field to 0 before computing
-    uint16_t checksum = in_cksum((unsigned short *)packet, 7 + payload_size);
-    memcpy(packet + 4, &checksum, 2);
+    finish_checksum(packet, payload_sum);
+
+    return HEADER_SIZE + payload_size;
+}
+
+/*Builds only the 7 byte header for a payload that stays where it is,
+  for packets sent with a header and payload iovec.
+  The checksum matches what build_packet would give for the same packet.
+  Returns the length of the whole packet*/
+int build_header(uint8_t *header, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size){
+    uint16_t payload_sum = 0;
+
+    if (payload != NULL && payload_size > 0){
+        payload_sum = cksum_fold(cksum_accumulate(NULL, payload, payload_size));
+    }else{
+        payload_size = 0;
+    }
+
+    return build_header_summed(header, seq_num, flag, payload_size, payload_sum);
+}
+
+/*build_header for a payload whose sum is already known (a checksum
+  index), the payload itself is not read*/
+int build_header_summed(uint8_t *header, uint32_t seq_num, uint8_t flag, int payload_size, uint16_t payload_sum){
+    write_header(header, seq_num, flag);
+    finish_checksum(header, payload_sum);
+
+    return HEADER_SIZE + payload_size;
+}
+
+/*Changes the flag of a built header and patches its checksum to match
+  (RFC 1624), without touching the payload it covers*/
+void rewrite_flag(uint8_t *header, uint8_t flag){
+    if (header[6] == flag){
+        return;
+    }
+
+    // The flag is the first byte of the word it shares with the payload
+    uint16_t old_word = 0, new_word = 0;
+    *(uint8_t *)&old_word = header[6];
+    *(uint8_t *)&new_word = flag;
+
+    // HC' = ~(~HC + ~m + m')
+    uint16_t checksum;
+    memcpy(&checksum, header + 4, 2);
+    uint64_t sum = (uint16_t)~checksum + (uint16_t)~old_word + new_word;
+    checksum = ~cksum_fold(sum);
 
-    return packet_len;
+    header[6] = flag;
+    memcpy(header + 4, &checksum, 2);
 }
@@ -21,18 +21,35 @@
 #define HEADER_SIZE 7 
 #define MAX_FILENAME_SIZE 100
 #define MAX_PDU 1407
+// Sequence numbers one SACK can report past its cumulative ack
+#define SACK_MAX_BITS 1024
 
 //Packet Flags 
 #define FLAG_RR             5 
 #define FLAG_SREJ           6
+#define FLAG_SACK           7
 #define FLAG_FILENAME       8 
 #define FLAG_FILENAME_ACK   9 
 #define FLAG_EOF            10
 #define FLAG_DATA           16
 #define FLAG_RESENT_DATA    17
 #define FLAG_RESENT_TIMEOUT 18
+#define FLAG_PARITY         19
 #define FLAG_FILENAME_ERROR 32
 
+//An RR is the packet header and the next expected sequence number,
+//newer clients follow it with their receive window (4 bytes each)
+
+//Transfer classes, the byte after the filename's NUL in a filename packet.
+//Servers that don't know the field stop at the NUL and serve it as normal
+#define TRANSFER_NORMAL     0
+#define TRANSFER_BACKGROUND 1
+
+//Optional FEC request after the transfer class: data packets then parity
+//packets per block. A server that takes it echoes both bytes in the
+//filename ack's payload
+#define FEC_REQUEST_LEN     2
+
 //Struct for packete 
 typedef struct {
     uint32_t sequence_num; //In network order
@@ -43,5 +60,8 @@ typedef struct {
 
 
 int build_packet(uint8_t *packet, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size);
+int build_header(uint8_t *header, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size);
+int build_header_summed(uint8_t *header, uint32_t seq_num, uint8_t flag, int payload_size, uint16_t payload_sum);
+void rewrite_flag(uint8_t *header, uint8_t flag);
 
 #endif
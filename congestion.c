@@ -0,0 +1,147 @@
+/* Congestion control for the server's send window. A session asks
+   congestion_window how many packets it may have in flight and reports
+   RRs, SREJs and timeouts back. The algorithm behind it is picked per
+   session from the CongestionOps table. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "congestion.h"
+
+static const CongestionOps *algorithms[] = {
+    &congestion_newreno,
+    &congestion_bbr,
+    &congestion_ledbat,
+    &congestion_none,
+};
+#define ALGORITHM_COUNT (int)(sizeof(algorithms) / sizeof(algorithms[0]))
+
+/*Returns the algorithm called name, or NULL if there is none*/
+const CongestionOps *congestion_find(const char *name){
+    for (int i = 0; i < ALGORITHM_COUNT; i++){
+        if (strcmp(algorithms[i]->name, name) == 0){
+            return algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+void congestion_init(CongestionControl *cc, const CongestionOps *ops, int receiver_window){
+    memset(cc, 0, sizeof(CongestionControl));
+    cc->ops = ops;
+    cc->receiver_window = receiver_window;
+    cc->cwnd = receiver_window;
+    cc->ssthresh = receiver_window;
+    if (ops->init != NULL){
+        ops->init(cc);
+    }
+}
+
+/*Packets the session may have in flight right now*/
+int congestion_window(const CongestionControl *cc){
+    if (cc->cwnd > cc->receiver_window){
+        return cc->receiver_window;
+    }
+    return cc->cwnd;
+}
+
+void congestion_on_ack(CongestionControl *cc, const CongestionSignal *signal){
+    if (cc->ops->on_ack != NULL){
+        cc->ops->on_ack(cc, signal);
+    }
+}
+
+void congestion_on_loss(CongestionControl *cc, const CongestionSignal *signal){
+    if (cc->ops->on_loss != NULL){
+        cc->ops->on_loss(cc, signal);
+    }
+}
+
+void congestion_on_timeout(CongestionControl *cc, const CongestionSignal *signal){
+    if (cc->ops->on_timeout != NULL){
+        cc->ops->on_timeout(cc, signal);
+    }
+}
+
+/*Frees whatever state the algorithm's init allocated*/
+void congestion_free(CongestionControl *cc){
+    free(cc->priv);
+    cc->priv = NULL;
+}
+
+/*////////////////////////////// NewReno (RFC 6582) ///////////////////////////////
+  Slow start doubles the window every round trip up to ssthresh, then
+  congestion avoidance adds one packet per window. An SREJ halves the
+  window once per window of data: further SREJs for packets sent before
+  the first one was answered are the same congestion event*/
+
+static void newreno_init(CongestionControl *cc){
+    cc->cwnd = CONGESTION_INITIAL_WINDOW;
+}
+
+static void newreno_on_ack(CongestionControl *cc, const CongestionSignal *signal){
+    if (signal->acked <= 0){
+        return;
+    }
+
+    if (cc->in_recovery){
+        if (signal->seq < cc->recover){
+            return; // Partial ack, the holes are being resent by SREJ
+        }
+        cc->in_recovery = false;
+        cc->cwnd = cc->ssthresh;
+        return;
+    }
+
+    if (cc->cwnd < cc->ssthresh){
+        cc->cwnd += signal->acked;
+    }else{
+        cc->acked_in_cwnd += signal->acked;
+        while (cc->acked_in_cwnd >= cc->cwnd){
+            cc->acked_in_cwnd -= cc->cwnd;
+            cc->cwnd++;
+        }
+    }
+
+    // Growing past what the receiver takes only makes the next cut slower
+    if (cc->cwnd > cc->receiver_window){
+        cc->cwnd = cc->receiver_window;
+    }
+}
+
+static int half_flight(const CongestionSignal *signal){
+    int half = signal->in_flight / 2;
+    return half < CONGESTION_MIN_WINDOW ? CONGESTION_MIN_WINDOW : half;
+}
+
+static void newreno_on_loss(CongestionControl *cc, const CongestionSignal *signal){
+    if (cc->in_recovery){
+        return;
+    }
+    cc->ssthresh = half_flight(signal);
+    cc->cwnd = cc->ssthresh;
+    cc->acked_in_cwnd = 0;
+    cc->in_recovery = true;
+    cc->recover = signal->next_seq;
+}
+
+static void newreno_on_timeout(CongestionControl *cc, const CongestionSignal *signal){
+    cc->ssthresh = half_flight(signal);
+    cc->cwnd = 1;
+    cc->acked_in_cwnd = 0;
+    cc->in_recovery = false;
+    cc->recover = signal->next_seq;
+}
+
+const CongestionOps congestion_newreno = {
+    .name = "reno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .on_loss = newreno_on_loss,
+    .on_timeout = newreno_on_timeout,
+};
+
+/*No congestion control, the receiver window is the only limit*/
+const CongestionOps congestion_none = {
+    .name = "none",
+};
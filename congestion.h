@@ -0,0 +1,61 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdbool.h>
+
+// Congestion window a session starts with, in packets (RFC 6928)
+#define CONGESTION_INITIAL_WINDOW 10
+// Smallest window after a loss, in packets
+#define CONGESTION_MIN_WINDOW 2
+
+/*What the session knows when an RR, SREJ or timeout reaches the controller*/
+typedef struct {
+    int seq;        // Sequence number the RR or SREJ carried
+    int acked;      // Packets the RR newly covers, 0 for other events
+    int in_flight;  // Sent and not acknowledged, before this event
+    int next_seq;   // Next sequence number the session will send
+    long now_us;    // rtt_now_us() when the event was handled
+    long rtt_us;    // Round trip sample taken with this RR, -1 for none
+} CongestionSignal;
+
+typedef struct CongestionControl CongestionControl;
+
+/*One congestion control algorithm. Every hook may be NULL. An
+  algorithm that keeps more state than CongestionControl has allocates
+  it in init and hangs it on priv, congestion_free frees it*/
+typedef struct {
+    const char *name;
+    void (*init)(CongestionControl *cc);
+    void (*on_ack)(CongestionControl *cc, const CongestionSignal *signal);
+    void (*on_loss)(CongestionControl *cc, const CongestionSignal *signal);
+    void (*on_timeout)(CongestionControl *cc, const CongestionSignal *signal);
+} CongestionOps;
+
+/*Per session controller state. cwnd is what the session may have in
+  flight, it never goes past the receiver window*/
+struct CongestionControl {
+    const CongestionOps *ops;
+    int receiver_window; // Window size rcopy asked for
+    int cwnd;            // Packets allowed in flight
+    int ssthresh;        // Slow start below this, congestion avoidance above
+    int acked_in_cwnd;   // Packets acked toward the next +1 in congestion avoidance
+    bool in_recovery;    // A loss was answered and its window is not acked yet
+    int recover;         // next_seq when recovery started, acking it ends recovery
+    double pacing_rate;  // Packets per second the session spreads sends at, 0 for unpaced
+    void *priv;          // The algorithm's own state, only its hooks look inside
+};
+
+extern const CongestionOps congestion_none;
+extern const CongestionOps congestion_newreno;
+extern const CongestionOps congestion_bbr;
+extern const CongestionOps congestion_ledbat;
+
+const CongestionOps *congestion_find(const char *name);
+void congestion_init(CongestionControl *cc, const CongestionOps *ops, int receiver_window);
+int congestion_window(const CongestionControl *cc);
+void congestion_on_ack(CongestionControl *cc, const CongestionSignal *signal);
+void congestion_on_loss(CongestionControl *cc, const CongestionSignal *signal);
+void congestion_on_timeout(CongestionControl *cc, const CongestionSignal *signal);
+void congestion_free(CongestionControl *cc);
+
+#endif
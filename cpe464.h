@@ -9,12 +9,20 @@
  * a 16-bit, unsigned short
  */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 unsigned short in_cksum(unsigned short *addr, int len);
 
+/* The pieces in_cksum is made of, for sums built up from several
+ * buffers: cksum_accumulate adds len bytes (copying them to dst too
+ * when dst is not NULL) and cksum_fold turns the total into 16 bits */
+uint64_t cksum_accumulate(void *dst, const void *src, int len);
+unsigned short cksum_fold(uint64_t sum);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,115 @@
+/* rcopy's disk writer thread. The network loop copies each chunk the
+   file is ready for into the ring and goes straight back to the
+   socket, the writer thread does the fwrite or pwrite. The free slots
+   of the ring are what rcopy advertises as its receive window, so a
+   disk that falls behind slows the server down instead of making the
+   kernel drop datagrams. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskWriter.h"
+#include "safeUtil.h"
+
+static void write_chunk(DiskWriter *writer, unsigned slot){
+    uint8_t *chunk = writer->chunks + (size_t)slot * writer->chunk_size;
+    int len = writer->len[slot];
+
+    if (writer->offset[slot] < 0){
+        if (len > 0 && fwrite(chunk, len, 1, writer->file) != 1){
+            perror("fwrite");
+            exit(-1);
+        }
+    }else if (len > 0 && pwrite(fileno(writer->file), chunk, len, writer->offset[slot]) != len){
+        perror("pwrite");
+        exit(-1);
+    }
+}
+
+static void *writer_main(void *arg){
+    DiskWriter *writer = (DiskWriter *)arg;
+
+    while (1){
+        while (sem_wait(&writer->ready) < 0){
+            // Interrupted by a signal, wait again
+        }
+        unsigned head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(&writer->tail, memory_order_acquire);
+        if (head == tail){
+            break; // Every chunk is written, this was the close
+        }
+        write_chunk(writer, head & writer->mask);
+        atomic_store_explicit(&writer->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+/*Starts a writer thread for file. The ring holds a window of chunks,
+  capped at DISK_WRITER_MAX_SLOTS*/
+DiskWriter *disk_writer_create(FILE *file, int chunk_size, int window_size){
+    DiskWriter *writer = (DiskWriter *)sCalloc(1, sizeof(DiskWriter));
+
+    writer->size = 1;
+    while (writer->size < (unsigned)window_size && writer->size < DISK_WRITER_MAX_SLOTS){
+        writer->size <<= 1;
+    }
+    writer->mask = writer->size - 1;
+    writer->chunk_size = chunk_size;
+    writer->chunks = (uint8_t *)sCalloc(writer->size, chunk_size);
+    writer->len = (int *)sCalloc(writer->size, sizeof(int));
+    writer->offset = (off_t *)sCalloc(writer->size, sizeof(off_t));
+    atomic_init(&writer->head, 0);
+    atomic_init(&writer->tail, 0);
+    writer->file = file;
+
+    if (sem_init(&writer->ready, 0, 0) < 0){
+        perror("sem_init");
+        exit(-1);
+    }
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0){
+        perror("pthread_create");
+        exit(-1);
+    }
+    return writer;
+}
+
+/*Queues a chunk for the writer, offset -1 appends it to what was
+  queued before. The advertised window keeps the ring from filling.
+  Returns 0 without waiting if it is full anyway, the network loop
+  never stops for the disk*/
+int disk_writer_push(DiskWriter *writer, off_t offset, const uint8_t *data, int len){
+    unsigned tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&writer->head, memory_order_acquire) == writer->size){
+        return 0;
+    }
+
+    unsigned slot = tail & writer->mask;
+    memcpy(writer->chunks + (size_t)slot * writer->chunk_size, data, len);
+    writer->len[slot] = len;
+    writer->offset[slot] = offset;
+    atomic_store_explicit(&writer->tail, tail + 1, memory_order_release);
+    sem_post(&writer->ready);
+    return 1;
+}
+
+/*Free slots in the ring*/
+int disk_writer_space(DiskWriter *writer){
+    unsigned tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&writer->head, memory_order_acquire);
+    return writer->size - (tail - head);
+}
+
+/*Waits for every queued chunk to be written, then stops the thread.
+  The file is left open for the caller*/
+void disk_writer_close(DiskWriter *writer){
+    sem_post(&writer->ready);
+    pthread_join(writer->thread, NULL);
+    sem_destroy(&writer->ready);
+    free(writer->chunks);
+    free(writer->len);
+    free(writer->offset);
+    free(writer);
+}
@@ -0,0 +1,38 @@
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+
+// Most chunks queued for the disk, the ring is the window size rounded up to a power of two below this
+#define DISK_WRITER_MAX_SLOTS 4096
+
+/*Hands received chunks from rcopy's network loop to a writer thread
+  through a single producer, single consumer ring, so a slow disk never
+  holds up draining the socket. Only the network loop moves tail and
+  only the writer moves head, neither takes a lock. The semaphore only
+  puts the writer to sleep while the ring is empty*/
+typedef struct {
+    uint8_t *chunks;     // size chunks of chunk_size bytes
+    int *len;
+    off_t *offset;       // Where each chunk goes in the file, -1 to append
+    unsigned size;       // Slots, a power of two
+    unsigned mask;
+    int chunk_size;
+    _Alignas(64) atomic_uint head; // Next slot the writer takes
+    _Alignas(64) atomic_uint tail; // Next slot the network loop fills
+    sem_t ready;         // Posted once per queued chunk, and once to close
+    FILE *file;
+    pthread_t thread;
+} DiskWriter;
+
+DiskWriter *disk_writer_create(FILE *file, int chunk_size, int window_size);
+int disk_writer_push(DiskWriter *writer, off_t offset, const uint8_t *data, int len);
+int disk_writer_space(DiskWriter *writer);
+void disk_writer_close(DiskWriter *writer);
+
+#endif
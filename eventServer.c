@@ -0,0 +1,376 @@
+/* Single process server. Every transfer is a Session multiplexed on one
+   epoll loop in place of a forked child, each session still sends from
+   its own socket so rcopy sees the same protocol as the forking server.
+   The threaded mode runs one of these loops per worker thread. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "eventServer.h"
+#include "networks.h"
+#include "safeUtil.h"
+
+static void event_server_init(EventServer *server, int listen_socket, const ServerOptions *options);
+static void watch_socket(EventServer *server, int socketNum);
+static void accept_filenames(EventServer *server);
+static void end_session(EventServer *server, Session *session);
+static void schedule_session(EventServer *server, Session *session);
+static void unschedule_session(EventServer *server, Session *session);
+static void fire_timers(EventServer *server);
+static void arm_wake_timer(EventServer *server);
+static void raise_file_limit(void);
+static void *worker_main(void *arg);
+#ifdef USE_IO_URING
+static void reap_completions(EventServer *server);
+#endif
+
+typedef struct {
+    int listen_socket;
+    const ServerOptions *options;
+} WorkerArgs;
+
+/*Runs the event loop forever on an already bound listening socket*/
+void event_server_run(int listen_socket, const ServerOptions *options){
+    EventServer server;
+    struct epoll_event events[EVENT_SERVER_MAX_EVENTS];
+
+    raise_file_limit();
+    event_server_init(&server, listen_socket, options);
+
+    while (1) { //Terminates when we ctrl c
+#ifdef USE_IO_URING
+        // Reads and sends queued since the last pass go in one io_uring_enter
+        if (server.ring != NULL){
+            uring_submit(server.ring);
+        }
+#endif
+        // Session timers come in through wake_timer, no timeout needed
+        int ready = epoll_wait(server.epoll_fd, events, EVENT_SERVER_MAX_EVENTS, -1);
+        if (ready < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait");
+            exit(-1);
+        }
+
+        for (int i = 0; i < ready; i++){
+            int socketNum = events[i].data.fd;
+            if (socketNum == server.listen_socket){
+                accept_filenames(&server);
+                continue;
+            }
+#ifdef USE_IO_URING
+            if (server.ring != NULL && socketNum == server.ring->event_fd){
+                reap_completions(&server);
+                continue;
+            }
+#endif
+            if (socketNum == server.wake_timer){
+                pace_timer_clear(server.wake_timer);
+                server.wake_armed_us = 0;
+                continue;
+            }
+
+            Session *session = server.sessions[socketNum];
+            if (session == NULL){
+                continue;
+            }
+            session_readable(session, server.acks);
+            if (session->state == DONE){
+                end_session(&server, session);
+            }else{
+                schedule_session(&server, session);
+            }
+        }
+
+        fire_timers(&server);
+        arm_wake_timer(&server);
+    }
+}
+
+/*Starts one event loop thread per worker. Every worker binds its own
+  SO_REUSEPORT socket on the port, so the kernel hashes each client to
+  one worker and that worker runs the handshake and the whole transfer.
+  Workers share nothing. Never returns*/
+void event_server_run_workers(int serverPort, int workers, const ServerOptions *options){
+    pthread_t *threads = (pthread_t *)sCalloc(workers, sizeof(pthread_t));
+    WorkerArgs *args = (WorkerArgs *)sCalloc(workers, sizeof(WorkerArgs));
+
+    raise_file_limit();
+
+    for (int i = 0; i < workers; i++){
+        args[i].listen_socket = udpServerSetupReusePort(serverPort);
+        args[i].options = options;
+
+        // Port 0 lets the OS pick for the first worker, the rest join it
+        if (serverPort == 0){
+            struct sockaddr_in6 address;
+            socklen_t address_len = sizeof(address);
+            getsockname(args[i].listen_socket, (struct sockaddr *)&address, &address_len);
+            serverPort = ntohs(address.sin6_port);
+        }
+    }
+
+    for (int i = 0; i < workers; i++){
+        if (pthread_create(&threads[i], NULL, worker_main, &args[i]) != 0){
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+    printf("Started %d workers on port %d\n", workers, serverPort);
+
+    for (int i = 0; i < workers; i++){
+        pthread_join(threads[i], NULL);
+    }
+    free(args);
+    free(threads);
+}
+
+static void *worker_main(void *arg){
+    WorkerArgs *args = (WorkerArgs *)arg;
+    event_server_run(args->listen_socket, args->options);
+    return NULL;
+}
+
+static void event_server_init(EventServer *server, int listen_socket, const ServerOptions *options){
+    if ((server->epoll_fd = epoll_create1(0)) < 0){
+        perror("epoll_create1");
+        exit(-1);
+    }
+
+    server->listen_socket = listen_socket;
+    server->table_size = 0;
+    server->sessions = NULL;
+    server->timers = NULL;
+    server->timer_count = 0;
+    server->timers_size = 0;
+    server->active = 0;
+    server->options = options;
+    server->batch = send_batch_create(options->emulate_errors);
+    server->acks = recv_batch_create();
+    server->filenames = recv_batch_create();
+    server->ring = NULL;
+    server->wake_timer = pace_timer_create();
+    server->wake_armed_us = 0;
+
+    watch_socket(server, listen_socket);
+    watch_socket(server, server->wake_timer);
+
+#ifdef USE_IO_URING
+    if (options->use_uring){
+        server->ring = uring_create(URING_ENTRIES);
+        if (server->ring != NULL){
+            watch_socket(server, server->ring->event_fd);
+        }else{
+            printf("io_uring unavailable, using blocking reads and sends\n");
+        }
+    }
+#endif
+}
+
+/*Adds a socket to the epoll set and makes sure the session table can
+  be indexed by it*/
+static void watch_socket(EventServer *server, int socketNum){
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = socketNum;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, socketNum, &event) < 0){
+        perror("epoll_ctl");
+        exit(-1);
+    }
+
+    if (socketNum >= server->table_size){
+        int new_size = socketNum + EVENT_SERVER_MAX_EVENTS;
+        server->sessions = srealloc(server->sessions, new_size * sizeof(Session *));
+        memset(server->sessions + server->table_size, 0, (new_size - server->table_size) * sizeof(Session *));
+        server->table_size = new_size;
+    }
+}
+
+/*Starts a session for every valid filename packet queued on the
+  listening socket*/
+static void accept_filenames(EventServer *server){
+    int packet_len = 0;
+    uint8_t *packet;
+    struct sockaddr_in6 client;
+
+    while (recv_batch_fill(server->filenames, server->listen_socket) > 0){
+        while ((packet = recv_batch_next(server->filenames, &packet_len, &client)) != NULL){
+            TransferRequest request;
+            FILE *export_file = process_filename_packet(server->batch, server->listen_socket, &client, packet, packet_len, &request);
+            if (export_file == NULL){
+                continue;
+            }
+
+            //Open new socket for the session
+            int session_socket = udpServerSetup(0);
+            watch_socket(server, session_socket);
+
+            Session *session = session_create(session_socket, &client, export_file, &request, server->batch, server->options);
+            session->ring = server->ring;
+            server->sessions[session_socket] = session;
+            server->active++;
+            printf("Session started on socket %d, %d active\n", session_socket, server->active);
+
+            handle_send_data(session, server->acks);
+            if (session->state == DONE){
+                end_session(server, session);
+            }else{
+                schedule_session(server, session);
+            }
+        }
+    }
+}
+
+/*Takes a finished session out of the loop. With io_uring requests
+  still in flight the memory stays until the last one completes*/
+static void end_session(EventServer *server, Session *session){
+    int socketNum = session->socketNum;
+
+    if (server->sessions[socketNum] == session){
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, socketNum, NULL);
+        unschedule_session(server, session);
+        server->sessions[socketNum] = NULL;
+        server->active--;
+        printf("Session on socket %d done, %d active\n", socketNum, server->active);
+    }
+
+    if (session->io_inflight == 0){
+        session_free(session);
+        close(socketNum);
+    }
+}
+
+#ifdef USE_IO_URING
+/*Routes every io_uring completion back to its session*/
+static void reap_completions(EventServer *server){
+    UringRequest *request;
+    int result;
+
+    uring_clear_event(server->ring);
+    while (uring_next_completion(server->ring, &request, &result)){
+        Session *session = (Session *)request->owner;
+        session_io_complete(session, request, result);
+        uring_request_put(server->ring, request);
+
+        if (session->state == SEND_DATA && server->sessions[session->socketNum] == session){
+            handle_send_data(session, server->acks);
+        }
+        if (session->state == DONE){
+            end_session(server, session);
+        }else if (server->sessions[session->socketNum] == session){
+            schedule_session(server, session);
+        }
+    }
+}
+#endif
+
+/*Puts a session in slot of the timer heap*/
+static void place_timer(EventServer *server, int slot, Session *session){
+    server->timers[slot] = session;
+    session->timer_slot = slot;
+}
+
+/*Moves the session in slot up or down the heap to where its wake_us belongs*/
+static void sift_timer(EventServer *server, int slot){
+    Session *session = server->timers[slot];
+
+    while (slot > 0 && server->timers[(slot - 1) / 2]->wake_us > session->wake_us){
+        place_timer(server, slot, server->timers[(slot - 1) / 2]);
+        slot = (slot - 1) / 2;
+    }
+    while (2 * slot + 1 < server->timer_count){
+        int child = 2 * slot + 1;
+        if (child + 1 < server->timer_count && server->timers[child + 1]->wake_us < server->timers[child]->wake_us){
+            child++;
+        }
+        if (session->wake_us <= server->timers[child]->wake_us){
+            break;
+        }
+        place_timer(server, slot, server->timers[child]);
+        slot = child;
+    }
+    place_timer(server, slot, session);
+}
+
+/*Files a session in the timer heap under its current wake time. A
+  session only moves its timers while the loop is calling into it, so
+  the loop calls this after each of those calls*/
+static void schedule_session(EventServer *server, Session *session){
+    session->wake_us = session_wake_us(session);
+
+    if (session->timer_slot < 0){
+        if (server->timer_count == server->timers_size){
+            server->timers_size += EVENT_SERVER_MAX_EVENTS;
+            server->timers = srealloc(server->timers, server->timers_size * sizeof(Session *));
+        }
+        place_timer(server, server->timer_count++, session);
+    }
+    sift_timer(server, session->timer_slot);
+}
+
+/*Takes a session out of the timer heap, the last one fills its slot*/
+static void unschedule_session(EventServer *server, Session *session){
+    int slot = session->timer_slot;
+    if (slot < 0){
+        return;
+    }
+
+    session->timer_slot = -1;
+    Session *last = server->timers[--server->timer_count];
+    if (last != session){
+        place_timer(server, slot, last);
+        sift_timer(server, slot);
+    }
+}
+
+/*Runs session_timer for the sessions whose deadline or paced send is
+  due, taking them off the top of the heap. Each session gets at most
+  one turn a pass, one still due after it waits for the next pass*/
+static void fire_timers(EventServer *server){
+    for (int turns = server->timer_count; turns > 0 && server->timer_count > 0; turns--){
+        Session *session = server->timers[0];
+        if (!session_timer_due(session)){
+            break;
+        }
+
+        session_timer(session, server->acks);
+        if (session->state == DONE){
+            end_session(server, session);
+        }else{
+            schedule_session(server, session);
+        }
+    }
+}
+
+/*Points the wake timer at the earliest session in the heap. It fires
+  on the microsecond, for deadlines and paced sends alike*/
+static void arm_wake_timer(EventServer *server){
+    long earliest = server->timer_count > 0 ? server->timers[0]->wake_us : 0;
+
+    if (earliest != server->wake_armed_us){
+        pace_timer_arm(server->wake_timer, earliest);
+        server->wake_armed_us = earliest;
+    }
+}
+
+/*Each session holds a socket and a file open, so lift the soft
+  descriptor limit as far as the hard limit allows*/
+static void raise_file_limit(void){
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
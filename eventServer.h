@@ -0,0 +1,34 @@
+#ifndef EVENT_SERVER_H
+#define EVENT_SERVER_H
+
+#include "session.h"
+
+// Most epoll events handled per epoll_wait call
+#define EVENT_SERVER_MAX_EVENTS 256
+
+/*All the sessions of one event loop. The table is indexed by the
+  session's socket number, grown the same way pollLib grows its set.
+  The timer heap holds the same sessions ordered on wake_us, so the
+  loop only looks at the sessions that are due*/
+typedef struct {
+    int epoll_fd;
+    int listen_socket;
+    Session **sessions;
+    int table_size;
+    Session **timers;        // Binary min heap on wake_us
+    int timer_count;
+    int timers_size;         // Slots allocated for timers
+    int active;              // Sessions currently running
+    SendBatch *batch;        // Shared by every session of this loop
+    RecvBatch *acks;         // Packets from session sockets
+    RecvBatch *filenames;    // Packets from the listening socket
+    UringIO *ring;           // NULL unless io_uring is in use
+    int wake_timer;          // Wakes the loop for the earliest deadline or paced send
+    long wake_armed_us;      // What wake_timer is armed for, 0 when disarmed
+    const ServerOptions *options;
+} EventServer;
+
+void event_server_run(int listen_socket, const ServerOptions *options);
+void event_server_run_workers(int serverPort, int workers, const ServerOptions *options);
+
+#endif
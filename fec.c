@@ -0,0 +1,206 @@
+/* Forward error correction with XOR parity. The server sums every block
+   of data packets into a few parity packets, and rcopy rebuilds a data
+   packet that went missing from the rest of its group and the group's
+   parity, without waiting a round trip for the retransmission. XOR only
+   mends one loss per group, the parity count per block buys more. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+#include "safeUtil.h"
+#include "communication.h"
+
+static void xor_into(uint8_t *sum, const uint8_t *data, int len){
+    for (int i = 0; i < len; i++){
+        sum[i] ^= data[i];
+    }
+}
+
+/*True for a block shape both ends can handle*/
+int fec_valid_ratio(int data, int parity){
+    return data > 0 && data <= FEC_MAX_DATA && parity > 0 && parity <= FEC_MAX_PARITY && parity <= data;
+}
+
+FecEncoder *fec_encoder_create(int data, int parity, int buffer_size){
+    FecEncoder *encoder = (FecEncoder *)sCalloc(1, sizeof(FecEncoder));
+
+    encoder->data = data;
+    encoder->parity = parity;
+    encoder->buffer_size = buffer_size;
+    encoder->next_seq = -1;
+    encoder->usable = 0;
+    encoder->sums = (uint8_t *)sCalloc(parity, buffer_size);
+    return encoder;
+}
+
+/*Adds a data packet as it is sent for the first time.
+  Returns 1 when it completes a block whose parity can be sent, every
+  packet of it full and added in order*/
+int fec_encode(FecEncoder *encoder, int sequence_num, const uint8_t *payload, int len){
+    int position = sequence_num % encoder->data;
+
+    if (position == 0){
+        memset(encoder->sums, 0, encoder->parity * encoder->buffer_size);
+        encoder->next_seq = sequence_num;
+        encoder->usable = 1;
+    }
+    // An io_uring read completing out of order or a short chunk spoils the block
+    if (!encoder->usable || sequence_num != encoder->next_seq || len != encoder->buffer_size){
+        encoder->usable = 0;
+        return 0;
+    }
+
+    xor_into(encoder->sums + (position % encoder->parity) * encoder->buffer_size, payload, len);
+    encoder->next_seq++;
+    return position == encoder->data - 1;
+}
+
+/*Payload of parity packet j of the block fec_encode just completed*/
+uint8_t *fec_encoder_parity(FecEncoder *encoder, int j){
+    return encoder->sums + j * encoder->buffer_size;
+}
+
+/*Sequence number parity packet j of the completed block goes out with*/
+int fec_encoder_parity_seq(FecEncoder *encoder, int j){
+    return (encoder->next_seq - 1) / encoder->data * encoder->parity + j;
+}
+
+void fec_encoder_free(FecEncoder *encoder){
+    free(encoder->sums);
+    free(encoder);
+}
+
+/*window_size is the receive window in packets, the decoder keeps enough
+  blocks to cover it*/
+FecDecoder *fec_decoder_create(int data, int parity, int buffer_size, int window_size){
+    FecDecoder *decoder = (FecDecoder *)sCalloc(1, sizeof(FecDecoder));
+
+    decoder->data = data;
+    decoder->parity = parity;
+    decoder->buffer_size = buffer_size;
+    decoder->slots = window_size / data + 2;
+    decoder->blocks = (FecBlock *)sCalloc(decoder->slots, sizeof(FecBlock));
+    for (int i = 0; i < decoder->slots; i++){
+        decoder->blocks[i].block = -1;
+        decoder->blocks[i].sums = (uint8_t *)sCalloc(parity, buffer_size);
+        decoder->blocks[i].parity = (uint8_t *)sCalloc(parity, buffer_size);
+    }
+    decoder->pending = (FecRecovered *)sCalloc(FEC_PENDING_MAX, sizeof(FecRecovered));
+    decoder->pending_head = 0;
+    decoder->pending_count = 0;
+    return decoder;
+}
+
+long fec_block_of(const FecDecoder *decoder, int sequence_num){
+    return sequence_num / decoder->data;
+}
+
+/*Returns the slot for block, emptying it if an older block held it.
+  NULL when the block is older than what the slot holds*/
+static FecBlock *find_block(FecDecoder *decoder, long block){
+    FecBlock *slot = &decoder->blocks[block % decoder->slots];
+
+    if (slot->block == block){
+        return slot;
+    }
+    if (slot->block > block){
+        return NULL;
+    }
+    slot->block = block;
+    slot->have = 0;
+    slot->parity_have = 0;
+    memset(slot->sums, 0, decoder->parity * decoder->buffer_size);
+    memset(slot->parity, 0, decoder->parity * decoder->buffer_size);
+    return slot;
+}
+
+/*Rebuilds the one data packet a group is missing once its parity is in.
+  The rebuilt packet is queued for fec_decoder_next*/
+static void try_rebuild(FecDecoder *decoder, FecBlock *slot, int group){
+    int buffer_size = decoder->buffer_size;
+    int missing = -1;
+
+    if (!(slot->parity_have & (1 << group))){
+        return;
+    }
+    for (int i = group; i < decoder->data; i += decoder->parity){
+        if (!(slot->have & (1ULL << i))){
+            if (missing >= 0){
+                return; // Two or more gone, XOR can't tell them apart
+            }
+            missing = i;
+        }
+    }
+    if (missing < 0 || decoder->pending_count == FEC_PENDING_MAX){
+        return;
+    }
+
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    memcpy(payload, slot->parity + group * buffer_size, buffer_size);
+    xor_into(payload, slot->sums + group * buffer_size, buffer_size);
+
+    int sequence_num = slot->block * decoder->data + missing;
+    FecRecovered *recovered = &decoder->pending[(decoder->pending_head + decoder->pending_count) % FEC_PENDING_MAX];
+    recovered->len = build_packet(recovered->packet, sequence_num, FLAG_DATA, payload, buffer_size);
+    decoder->pending_count++;
+    slot->have |= 1ULL << missing;
+    printf("FEC rebuilt packet #%d\n", sequence_num);
+}
+
+/*Adds a received data packet to its block*/
+void fec_decode_data(FecDecoder *decoder, int sequence_num, const uint8_t *payload, int len){
+    if (sequence_num < 0 || len > decoder->buffer_size){
+        return;
+    }
+    FecBlock *slot = find_block(decoder, fec_block_of(decoder, sequence_num));
+    int position = sequence_num % decoder->data;
+    if (slot == NULL || (slot->have & (1ULL << position))){
+        return;
+    }
+
+    int group = position % decoder->parity;
+    xor_into(slot->sums + group * decoder->buffer_size, payload, len);
+    slot->have |= 1ULL << position;
+    try_rebuild(decoder, slot, group);
+}
+
+/*Stores a received parity packet, parity_seq is its sequence number*/
+void fec_decode_parity(FecDecoder *decoder, int parity_seq, const uint8_t *payload, int len){
+    if (parity_seq < 0 || len != decoder->buffer_size){
+        return;
+    }
+    FecBlock *slot = find_block(decoder, parity_seq / decoder->parity);
+    int group = parity_seq % decoder->parity;
+    if (slot == NULL || (slot->parity_have & (1 << group))){
+        return;
+    }
+
+    memcpy(slot->parity + group * decoder->buffer_size, payload, len);
+    slot->parity_have |= 1 << group;
+    try_rebuild(decoder, slot, group);
+}
+
+/*Hands out the next rebuilt packet, built like a FLAG_DATA packet from
+  the server. It stays valid until the next call. NULL when none wait*/
+uint8_t *fec_decoder_next(FecDecoder *decoder, int *len){
+    if (decoder->pending_count == 0){
+        return NULL;
+    }
+    FecRecovered *recovered = &decoder->pending[decoder->pending_head];
+    decoder->pending_head = (decoder->pending_head + 1) % FEC_PENDING_MAX;
+    decoder->pending_count--;
+    *len = recovered->len;
+    return recovered->packet;
+}
+
+void fec_decoder_free(FecDecoder *decoder){
+    for (int i = 0; i < decoder->slots; i++){
+        free(decoder->blocks[i].sums);
+        free(decoder->blocks[i].parity);
+    }
+    free(decoder->blocks);
+    free(decoder->pending);
+    free(decoder);
+}
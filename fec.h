@@ -0,0 +1,72 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+
+// Most data packets in one FEC block, the decoder tracks them in a uint64_t
+#define FEC_MAX_DATA 64
+// Most parity packets per block
+#define FEC_MAX_PARITY 8
+// Recovered packets waiting to be handed to the receive states
+#define FEC_PENDING_MAX 64
+
+/*XOR parity over blocks of data packets. Block b holds data sequence
+  numbers [b * data, (b + 1) * data). Parity packet j of the block is
+  the XOR of the payloads of every packet i of the block with
+  i % parity == j, so one loss in each of those groups can be rebuilt.
+  Parity packets go out with FLAG_PARITY and sequence number
+  b * parity + j. Only blocks of full buffer_size chunks get parity,
+  the short last chunk of a file is left to retransmission*/
+
+/*Server side: sums a block up as it is sent*/
+typedef struct {
+    int data;             // Data packets per block
+    int parity;           // Parity packets per block
+    int buffer_size;
+    int next_seq;         // Sequence number the block expects next, -1 before the first
+    int usable;           // Every packet so far was a full chunk sent in order
+    uint8_t *sums;        // parity running XORs of buffer_size bytes
+} FecEncoder;
+
+/*Client side: one block in the decoder's ring*/
+typedef struct {
+    long block;           // Block number, -1 for an empty slot
+    uint64_t have;        // Data packets of the block received or rebuilt
+    uint8_t parity_have;  // Parity packets of the block received
+    uint8_t *sums;        // Running XOR of the received data of each group
+    uint8_t *parity;      // Received parity payloads
+} FecBlock;
+
+/*A rebuilt data packet, ready to go through the receive states*/
+typedef struct {
+    uint8_t packet[7 + 1400];
+    int len;
+} FecRecovered;
+
+typedef struct {
+    int data;
+    int parity;
+    int buffer_size;
+    int slots;            // Blocks kept, enough for the receive window
+    FecBlock *blocks;
+    FecRecovered *pending; // FEC_PENDING_MAX rebuilt packets
+    int pending_head;
+    int pending_count;
+} FecDecoder;
+
+int fec_valid_ratio(int data, int parity);
+
+FecEncoder *fec_encoder_create(int data, int parity, int buffer_size);
+int fec_encode(FecEncoder *encoder, int sequence_num, const uint8_t *payload, int len);
+uint8_t *fec_encoder_parity(FecEncoder *encoder, int j);
+int fec_encoder_parity_seq(FecEncoder *encoder, int j);
+void fec_encoder_free(FecEncoder *encoder);
+
+FecDecoder *fec_decoder_create(int data, int parity, int buffer_size, int window_size);
+long fec_block_of(const FecDecoder *decoder, int sequence_num);
+void fec_decode_data(FecDecoder *decoder, int sequence_num, const uint8_t *payload, int len);
+void fec_decode_parity(FecDecoder *decoder, int parity_seq, const uint8_t *payload, int len);
+uint8_t *fec_decoder_next(FecDecoder *decoder, int *len);
+void fec_decoder_free(FecDecoder *decoder);
+
+#endif
@@ -0,0 +1,134 @@
+/* LEDBAT (RFC 6817) style scavenger congestion control for background
+   transfers. The queuing delay is the current RTT over the smallest
+   RTT seen lately; the window grows while it is under a target and
+   shrinks in proportion once it is over, so a background copy backs
+   off as soon as other traffic starts filling the queues. Packets carry
+   no timestamps, so the round trip stands in for the one way delay. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "congestion.h"
+#include "safeUtil.h"
+
+#define LEDBAT_TARGET_US 25000L   // Queuing delay the transfer may add
+#define LEDBAT_GAIN 1.0           // Packets per round trip gained when the queue is empty
+#define LEDBAT_MIN_CWND 2
+#define LEDBAT_MINUTE_US 60000000L
+// Minutes of base delay history kept, one minimum per minute
+#define LEDBAT_BASE_HISTORY 10
+// Recent RTT samples the current delay is the minimum of
+#define LEDBAT_CURRENT_FILTER 4
+
+/*Delay state, kept in CongestionControl priv*/
+typedef struct {
+    double cwnd;                              // Fractional window, cc->cwnd is its floor
+    long base_rtt_us[LEDBAT_BASE_HISTORY];    // Smallest RTT of each recent minute, -1 for none
+    long base_minute;                         // Minute base_rtt_us[0] belongs to
+    long current_rtt_us[LEDBAT_CURRENT_FILTER]; // Latest RTT samples, -1 for none
+    int current_next;                         // Slot the next sample goes in
+    long last_loss_us;                        // Last window cut, one per round trip
+} LedbatState;
+
+static void ledbat_init(CongestionControl *cc){
+    LedbatState *ledbat = (LedbatState *)sCalloc(1, sizeof(LedbatState));
+
+    cc->priv = ledbat;
+    for (int i = 0; i < LEDBAT_BASE_HISTORY; i++){
+        ledbat->base_rtt_us[i] = -1;
+    }
+    for (int i = 0; i < LEDBAT_CURRENT_FILTER; i++){
+        ledbat->current_rtt_us[i] = -1;
+    }
+    ledbat->base_minute = -1;
+    ledbat->cwnd = LEDBAT_MIN_CWND;
+    cc->cwnd = LEDBAT_MIN_CWND;
+}
+
+/*Smallest non negative value of a history, -1 if there is none*/
+static long history_min(const long *history, int len){
+    long smallest = -1;
+    for (int i = 0; i < len; i++){
+        if (history[i] >= 0 && (smallest < 0 || history[i] < smallest)){
+            smallest = history[i];
+        }
+    }
+    return smallest;
+}
+
+static void add_sample(LedbatState *ledbat, long rtt_us, long now_us){
+    long minute = now_us / LEDBAT_MINUTE_US;
+
+    // Start a new base delay slot every minute, the oldest one drops out
+    if (minute != ledbat->base_minute){
+        long elapsed = ledbat->base_minute < 0 ? LEDBAT_BASE_HISTORY : minute - ledbat->base_minute;
+        for (long shift = 0; shift < elapsed && shift < LEDBAT_BASE_HISTORY; shift++){
+            memmove(ledbat->base_rtt_us + 1, ledbat->base_rtt_us, (LEDBAT_BASE_HISTORY - 1) * sizeof(long));
+            ledbat->base_rtt_us[0] = -1;
+        }
+        ledbat->base_minute = minute;
+    }
+    if (ledbat->base_rtt_us[0] < 0 || rtt_us < ledbat->base_rtt_us[0]){
+        ledbat->base_rtt_us[0] = rtt_us;
+    }
+
+    ledbat->current_rtt_us[ledbat->current_next] = rtt_us;
+    ledbat->current_next = (ledbat->current_next + 1) % LEDBAT_CURRENT_FILTER;
+}
+
+static void set_window(CongestionControl *cc, double cwnd){
+    if (cwnd < LEDBAT_MIN_CWND){
+        cwnd = LEDBAT_MIN_CWND;
+    }
+    if (cwnd > cc->receiver_window){
+        cwnd = cc->receiver_window;
+    }
+    ((LedbatState *)cc->priv)->cwnd = cwnd;
+    cc->cwnd = (int)cwnd;
+}
+
+static void ledbat_on_ack(CongestionControl *cc, const CongestionSignal *signal){
+    LedbatState *ledbat = (LedbatState *)cc->priv;
+
+    if (signal->rtt_us > 0){
+        add_sample(ledbat, signal->rtt_us, signal->now_us);
+    }
+    if (signal->acked <= 0){
+        return;
+    }
+
+    // No delay measured yet, grow as if the queue were empty
+    double off_target = 1.0;
+    long base = history_min(ledbat->base_rtt_us, LEDBAT_BASE_HISTORY);
+    long current = history_min(ledbat->current_rtt_us, LEDBAT_CURRENT_FILTER);
+    if (base >= 0 && current >= 0){
+        off_target = (double)(LEDBAT_TARGET_US - (current - base)) / LEDBAT_TARGET_US;
+    }
+
+    set_window(cc, ledbat->cwnd + LEDBAT_GAIN * off_target * signal->acked / ledbat->cwnd);
+}
+
+/*Halves the window, at most once a round trip*/
+static void ledbat_on_loss(CongestionControl *cc, const CongestionSignal *signal){
+    LedbatState *ledbat = (LedbatState *)cc->priv;
+    long round_trip = history_min(ledbat->current_rtt_us, LEDBAT_CURRENT_FILTER);
+
+    if (round_trip > 0 && signal->now_us - ledbat->last_loss_us < round_trip){
+        return;
+    }
+    ledbat->last_loss_us = signal->now_us;
+    set_window(cc, ledbat->cwnd / 2);
+}
+
+static void ledbat_on_timeout(CongestionControl *cc, const CongestionSignal *signal){
+    ((LedbatState *)cc->priv)->cwnd = 1;
+    cc->cwnd = 1;
+}
+
+const CongestionOps congestion_ledbat = {
+    .name = "ledbat",
+    .init = ledbat_init,
+    .on_ack = ledbat_on_ack,
+    .on_loss = ledbat_on_loss,
+    .on_timeout = ledbat_on_timeout,
+};
@@ -8,7 +8,7 @@ BUILD_MINOR=b
 TEST=test
 
 CC = g++
-CFLAGS = -g -Wall
+CFLAGS = -g -O2 -Wall
 
 PACKAGES = sendtoErr sendErr checksum
 HDRS = $(shell cd networks && ls *.hpp *.h 2> /dev/null)
@@ -49,38 +49,226 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CKSUM_X86 1
+#endif
+
 /*
- * in_cksum --
- *      Checksum routine for Internet Protocol family headers (C Version)
+ * The sum is the same whatever width the words are added in, as long as
+ * every carry is folded back in at the end.  So the kernels below add
+ * 32 bit (or wider) pieces into 64 bit accumulators and only fold once.
+ * The first call picks the widest kernel the CPU supports; every kernel
+ * gives the same answer as the original 16 bit loop.  A kernel given a
+ * dst copies the data there as it goes, so a packet being built is only
+ * read once.
  */
-unsigned short in_cksum(unsigned short *addr,int len)
+
+typedef uint64_t (*cksum_kernel)(unsigned char *dst, const unsigned char *data, int len);
+
+#define CKSUM_INLINE static inline __attribute__((always_inline))
+
+/* Fold a 64 bit ones complement sum down to 16 bits */
+unsigned short cksum_fold(uint64_t sum)
 {
-        register int sum = 0;
-        unsigned short answer = 0;
-        register unsigned short *w = addr;
-        register int nleft = len;
-
-        /*
-         * Our algorithm is simple, using a 32 bit accumulator (sum), we add
-         * sequential 16 bit words to it, and at the end, fold back all the
-         * carry bits from the top 16 bits into the lower 16 bits.
-         */
-        while (nleft > 1)  {
-                sum += *w++;
-                nleft -= 2;
+        sum = (sum >> 32) + (sum & 0xffffffff);
+        sum = (sum >> 32) + (sum & 0xffffffff);
+        sum = (sum >> 16) + (sum & 0xffff);
+        sum = (sum >> 16) + (sum & 0xffff);
+        sum = (sum >> 16) + (sum & 0xffff);
+        return (unsigned short)sum;
+}
+
+/* Sum of whatever is left after the wide loops: pairs of bytes read as
+   16 bit words, and an odd last byte padded with a zero like in_cksum */
+static uint64_t cksum_tail(unsigned char *dst, const unsigned char *data, int len)
+{
+        uint64_t sum = 0;
+        unsigned short word;
+
+        if (dst != NULL)
+                memcpy(dst, data, len);
+        while (len > 1) {
+                memcpy(&word, data, 2);
+                sum += word;
+                data += 2;
+                len -= 2;
         }
+        if (len == 1) {
+                word = 0;
+                *(unsigned char *)(&word) = *data;
+                sum += word;
+        }
+        return sum;
+}
 
-        /* mop up an odd byte, if necessary */
-        if (nleft == 1) {
-                *(unsigned char *)(&answer) = *(unsigned char *)w ;
-                sum += answer;
+/* Portable kernel: four 32 bit words at a time into four 64 bit
+   accumulators, which cannot overflow for any int length.  copy is a
+   constant in each caller, so the copying and summing only loops are
+   compiled separately */
+CKSUM_INLINE uint64_t scalar64_loop(unsigned char *dst, const unsigned char *data, int len, int copy)
+{
+        uint64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+        uint32_t w[4];
+
+        while (len >= 16) {
+                memcpy(w, data, 16);
+                if (copy) {
+                        memcpy(dst, w, 16);
+                        dst += 16;
+                }
+                sum0 += w[0];
+                sum1 += w[1];
+                sum2 += w[2];
+                sum3 += w[3];
+                data += 16;
+                len -= 16;
         }
+        return sum0 + sum1 + sum2 + sum3 + cksum_tail(copy ? dst : NULL, data, len);
+}
 
-        /* add back carry outs from top 16 bits to low 16 bits */
-        sum = (sum >> 16) + (sum & 0xffff);     /* add hi 16 to low 16 */
-        sum += (sum >> 16);                     /* add carry */
-        answer = ~sum;                          /* truncate to 16 bits */
-        return(answer);
+static uint64_t cksum_scalar64(unsigned char *dst, const unsigned char *data, int len)
+{
+        if (dst != NULL)
+                return scalar64_loop(dst, data, len, 1);
+        return scalar64_loop(NULL, data, len, 0);
+}
+
+#ifdef CKSUM_X86
+
+/* 16 bit words are widened to 32 bit lanes.  Each lane can take 65537
+   words before it could overflow, so lanes are emptied into the 64 bit
+   total at least that often */
+#define CKSUM_SIMD_BLOCK 32768
+
+__attribute__((target("sse2")))
+CKSUM_INLINE uint64_t sse2_loop(unsigned char *dst, const unsigned char *data, int len, int copy)
+{
+        const __m128i zero = _mm_setzero_si128();
+        uint64_t total = 0;
+        uint32_t lanes[4];
+
+        while (len >= 16) {
+                __m128i acc = _mm_setzero_si128();
+                int blocks = len / 16;
+                if (blocks > CKSUM_SIMD_BLOCK)
+                        blocks = CKSUM_SIMD_BLOCK;
+
+                for (int i = 0; i < blocks; i++) {
+                        __m128i v = _mm_loadu_si128((const __m128i *)data);
+                        if (copy) {
+                                _mm_storeu_si128((__m128i *)dst, v);
+                                dst += 16;
+                        }
+                        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+                        acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+                        data += 16;
+                }
+                len -= blocks * 16;
+
+                _mm_storeu_si128((__m128i *)lanes, acc);
+                total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+        return total + cksum_tail(copy ? dst : NULL, data, len);
+}
+
+__attribute__((target("sse2")))
+static uint64_t cksum_sse2(unsigned char *dst, const unsigned char *data, int len)
+{
+        if (dst != NULL)
+                return sse2_loop(dst, data, len, 1);
+        return sse2_loop(NULL, data, len, 0);
+}
+
+__attribute__((target("avx2")))
+CKSUM_INLINE uint64_t avx2_loop(unsigned char *dst, const unsigned char *data, int len, int copy)
+{
+        const __m256i zero = _mm256_setzero_si256();
+        uint64_t total = 0;
+        uint32_t lanes[8];
+
+        while (len >= 32) {
+                __m256i acc = _mm256_setzero_si256();
+                int blocks = len / 32;
+                if (blocks > CKSUM_SIMD_BLOCK)
+                        blocks = CKSUM_SIMD_BLOCK;
+
+                for (int i = 0; i < blocks; i++) {
+                        __m256i v = _mm256_loadu_si256((const __m256i *)data);
+                        if (copy) {
+                                _mm256_storeu_si256((__m256i *)dst, v);
+                                dst += 32;
+                        }
+                        acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+                        acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+                        data += 32;
+                }
+                len -= blocks * 32;
+
+                _mm256_storeu_si256((__m256i *)lanes, acc);
+                for (int i = 0; i < 8; i++)
+                        total += lanes[i];
+        }
+        /* Less than 32 bytes left, the scalar kernel finishes them */
+        return total + cksum_scalar64(copy ? dst : NULL, data, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(unsigned char *dst, const unsigned char *data, int len)
+{
+        if (dst != NULL)
+                return avx2_loop(dst, data, len, 1);
+        return avx2_loop(NULL, data, len, 0);
+}
+
+#endif
+
+static uint64_t cksum_resolve(unsigned char *dst, const unsigned char *data, int len);
+
+/* Starts at the resolver, which swaps in the real kernel on first use.
+   Threads racing on the first call all store the same pointer */
+static cksum_kernel cksum_impl = cksum_resolve;
+
+static uint64_t cksum_resolve(unsigned char *dst, const unsigned char *data, int len)
+{
+        cksum_kernel kernel = cksum_scalar64;
+
+#ifdef CKSUM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                kernel = cksum_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+                kernel = cksum_sse2;
+#endif
+        cksum_impl = kernel;
+        return kernel(dst, data, len);
+}
+
+/*
+ * cksum_accumulate --
+ *      Ones complement sum of len bytes at src, not folded yet, so sums
+ *      of several pieces can be added before cksum_fold.  When dst is
+ *      not NULL the bytes are copied there in the same pass
+ */
+uint64_t cksum_accumulate(void *dst, const void *src, int len)
+{
+        if (len <= 0)
+                return 0;
+        return cksum_impl((unsigned char *)dst, (const unsigned char *)src, len);
+}
+
+/*
+ * in_cksum --
+ *      Checksum routine for Internet Protocol family headers
+ *      (dispatches to a SIMD kernel where the CPU has one)
+ */
+unsigned short in_cksum(unsigned short *addr,int len)
+{
+        if (len <= 0)
+                return 0xffff;
+        return (unsigned short)~cksum_fold(cksum_impl(NULL, (const unsigned char *)addr, len));
 }
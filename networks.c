@@ -176,6 +176,51 @@ int udpServerSetup(int serverPort)
 	
 }
 
+// Same as udpServerSetup() but sets SO_REUSEPORT before binding so several
+// sockets (one per worker thread) can share the port. The kernel spreads
+// incoming datagrams over them by the sender's address.
+
+int udpServerSetupReusePort(int serverPort)
+{
+	struct sockaddr_in6 serverAddress;
+	int socketNum = 0;
+	int serverAddrLen = 0;
+	int reuse = 1;
+
+	// create the socket
+	if ((socketNum = socket(AF_INET6,SOCK_DGRAM,0)) < 0)
+	{
+		perror("socket() call error");
+		exit(-1);
+	}
+
+	if (setsockopt(socketNum, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+	{
+		perror("setsockopt(SO_REUSEPORT) call error");
+		exit(-1);
+	}
+
+	// set up the socket
+	memset(&serverAddress, 0, sizeof(struct sockaddr_in6));
+	serverAddress.sin6_family = AF_INET6;    		// internet (IPv6 or IPv4) family
+	serverAddress.sin6_addr = in6addr_any ;  		// use any local IP address
+	serverAddress.sin6_port = htons(serverPort);   // if 0 = os picks 
+
+	// bind the name (address) to a port
+	if (bind(socketNum,(struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0)
+	{
+		perror("bind() call error");
+		exit(-1);
+	}
+
+	/* Get the port number */
+	serverAddrLen = sizeof(serverAddress);
+	getsockname(socketNum,(struct sockaddr *) &serverAddress,  (socklen_t *) &serverAddrLen);
+	printf("---------------------------Server using Port #: %d---------------------------\n", ntohs(serverAddress.sin6_port));
+
+	return socketNum;
+}
+
 // This function opens a socket and fills in the serverAdress structure using the hostName and serverPort.  
 // It assumes the address structure is created before calling this.
 // Returns the socket number and the filled in serverAddress struct.
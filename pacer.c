@@ -0,0 +1,70 @@
+/* Packet pacing. A Pacer says when a session's next packet may leave,
+   and a pace timer (a timerfd on the rtt_now_us clock) wakes the loop
+   at that microsecond. The timer is a descriptor so the forked server's
+   pollCall and the event loop's epoll both wait on it with the sockets. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "pacer.h"
+
+void pacer_init(Pacer *pacer){
+    pacer->rate = 0;
+    pacer->next_send_us = 0;
+}
+
+void pacer_set_rate(Pacer *pacer, double rate){
+    pacer->rate = rate > 0 ? rate : 0;
+}
+
+/*True when another packet may be sent now*/
+int pacer_ready(const Pacer *pacer, long now_us){
+    return pacer->rate <= 0 || pacer->next_send_us <= now_us;
+}
+
+/*Moves the pacing clock on by one packet*/
+void pacer_sent(Pacer *pacer, long now_us){
+    if (pacer->rate <= 0){
+        return;
+    }
+    // A quiet spell does not bank credit for more than one burst
+    if (pacer->next_send_us < now_us - PACER_BURST_US){
+        pacer->next_send_us = now_us - PACER_BURST_US;
+    }
+    pacer->next_send_us += (long)(1000000.0 / pacer->rate);
+}
+
+/*Returns a disarmed pace timer*/
+int pace_timer_create(void){
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0){
+        perror("timerfd_create");
+        exit(-1);
+    }
+    return timer_fd;
+}
+
+/*Makes the timer readable at rtt_now_us() == at_us, 0 disarms it*/
+void pace_timer_arm(int timer_fd, long at_us){
+    struct itimerspec when = {0};
+
+    if (at_us > 0){
+        when.it_value.tv_sec = at_us / 1000000L;
+        when.it_value.tv_nsec = (at_us % 1000000L) * 1000L;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL) < 0){
+        perror("timerfd_settime");
+    }
+}
+
+/*Consumes an expiry so the timer stops being readable*/
+void pace_timer_clear(int timer_fd){
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0){
+        return; // Nothing pending, the timer was rearmed meanwhile
+    }
+}
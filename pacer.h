@@ -0,0 +1,24 @@
+#ifndef PACER_H
+#define PACER_H
+
+// Pacing credit a quiet pacer may bank, sent as one burst
+#define PACER_BURST_US 250
+// Spread over the RTT, a window based controller's cwnd is paced this much faster
+#define PACER_WINDOW_GAIN 1.25
+
+/*Spreads a session's packets evenly at rate packets per second*/
+typedef struct {
+    double rate;       // Packets per second, 0 for unpaced
+    long next_send_us; // rtt_now_us() before which the next packet is held
+} Pacer;
+
+void pacer_init(Pacer *pacer);
+void pacer_set_rate(Pacer *pacer, double rate);
+int pacer_ready(const Pacer *pacer, long now_us);
+void pacer_sent(Pacer *pacer, long now_us);
+
+int pace_timer_create(void);
+void pace_timer_arm(int timer_fd, long at_us);
+void pace_timer_clear(int timer_fd);
+
+#endif
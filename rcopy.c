@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <strings.h>
+#include <getopt.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -23,6 +24,18 @@
 #include "cpe464.h"
 #include "pollLib.h"
 #include "buffer.h"
+#include "recvBatch.h"
+#include "rtt.h"
+#include "fec.h"
+#include "diskWriter.h"
+
+// Retransmit timeouts in a row without a packet before giving up
+#define RCOPY_MAX_TIMEOUTS 10
+// Least time without progress before giving up, the server's own
+// timeouts back off as far as RTT_MAX_RTO_MS before it gives up
+#define RCOPY_GIVE_UP_MS (RTT_MAX_RTO_MS * RCOPY_MAX_TIMEOUTS)
+// Longest an in order packet's RR is held back waiting for the next one
+#define RCOPY_ACK_DELAY_MS 2
 
 typedef enum{
 	DONE, 
@@ -41,11 +54,29 @@ typedef enum{
 void send_filename(int socketNum, struct sockaddr_in6 *server, uint32_t window_size, uint32_t buffer_size, char *filename);
 void rcopy_FSM(int sockfd, struct sockaddr_in6 *server, char *argv[]);
 RcopyState filename_exchange(int socketNum, struct sockaddr_in6 *server, char *argv[]);
-void send_SREJ(int sockfd, struct sockaddr_in6 *server, uint32_t missing_seq);
 void send_rr(int sockfd, struct sockaddr_in6 *server, uint32_t next_expected_seq);
+void send_sack(int sockfd, struct sockaddr_in6 *server, CircularBuffer *buffer);
 
+int checkOptions(int argc, char *argv[]);
 int checkArgs(int argc, char *argv[]);
 int eof_seq_num = 0; //Store seq num of EOF packet
+uint8_t transfer_class = TRANSFER_NORMAL; // -b asks the server for a background transfer
+RttEstimator rtt; // Round trip estimate, first sampled from the filename exchange
+int quiet_timeouts = 0; // Timeouts since the server was last heard from
+long quiet_since_ms = 0; // When the server was last heard from, or last asked again
+int progress_seq = 0;    // buffer->current when it last moved
+long progress_since_ms = 0; // When buffer->current last moved
+int fec_data = 0;   // -F data packets per FEC block, 0 without FEC
+int fec_parity = 0; // -F parity packets per FEC block
+int fec_accepted = 0; // The server's filename ack echoed the FEC ratio
+FecDecoder *fec = NULL; // Set once the server agreed to send parity
+int ack_every = 2;  // -a: in order packets acknowledged by one RR
+int unacked = 0;    // In order packets received since the last RR or SACK
+long ack_due_ms = 0; // When a held back RR has to go out, 0 when none is held
+int direct_writes = 0; // -w: chunks are written straight to their offset in the file
+DiskWriter *writer = NULL; // Writer thread for the output file, started with the transfer
+int window_size = 0;       // Receive window asked for in the filename packet
+int advertised_window = 0; // Window sent in the last RR, the writer's free slots
 
 int main(int argc, char *argv[])
 {
@@ -53,6 +84,11 @@ int main(int argc, char *argv[])
 	struct sockaddr_in6 server; // Supports 4 and 6 but requires IPv6 struct
 	int portNumber = 0;
 
+	// Check options, then shift them out so the positional arguments keep their places
+	int optionCount = checkOptions(argc, argv);
+	argc -= optionCount;
+	argv += optionCount;
+
 	// Check arguments
 	portNumber = checkArgs(argc, argv);
 
@@ -68,7 +104,8 @@ int main(int argc, char *argv[])
 
 /*In this function we are going send the init packet to the server
 The 7 bytes header follows 32 bits seq# , 16 bits checksum,8 bits flag, and then filename.
-Max filename is 100 characters. */
+Max filename is 100 characters. The filename is NUL terminated and followed by the transfer class
+and, with -F, the FEC block shape. */
 void send_filename(int socketNum, struct sockaddr_in6 *server, uint32_t window_size, uint32_t buffer_size, char *filename)
 {
 	// printf("Window size: %d\n", window_size);
@@ -93,20 +130,27 @@ void send_filename(int socketNum, struct sockaddr_in6 *server, uint32_t window_s
 	uint32_t network_buffer_size = htonl(buffer_size);
 	memcpy(out_packet + 11, &network_buffer_size, 4);
 
-	// Add Filename (starting at byte 15)
-	strncpy((char *)(out_packet + 15), filename, strlen(filename));
+	// Add Filename (starting at byte 15), its NUL and the transfer class after it
+	memcpy(out_packet + 15, filename, strlen(filename));
+	out_packet[15 + strlen(filename)] = '\0';
+	out_packet[16 + strlen(filename)] = transfer_class;
+	int out_packet_len = 17 + strlen(filename);
+	if (fec_data > 0){
+		out_packet[out_packet_len] = fec_data;
+		out_packet[out_packet_len + 1] = fec_parity;
+		out_packet_len += FEC_REQUEST_LEN;
+	}
 
 	// Set checksum field (bytes 4-5) to 0 before computing checksum
 	memset(out_packet + 4, 0, 2);
 
-	uint16_t checksum = in_cksum((unsigned short *)out_packet, 15 + strlen(filename));
+	uint16_t checksum = in_cksum((unsigned short *)out_packet, out_packet_len);
 
 	// Store checksum in bytes 4-5
 	memcpy(out_packet + 4, &checksum, 2);
 
 	// Send filename packet ot the server
 	int serverAddrLen = sizeof(struct sockaddr_in6);
-	int out_packet_len = 15 + strlen(filename);
 	printf("packet length = %d\n", out_packet_len);
 
 	safeSendto(socketNum, out_packet, out_packet_len, 0, (struct sockaddr *)server, serverAddrLen);
@@ -146,6 +190,11 @@ int process_filename_response(uint8_t *in_buffer, int in_buff_len)
 		exit(1);
 	}else if (flag == FLAG_FILENAME_ACK){
 		printf("Filename exist, the server will be sending data\n");
+		// A server without FEC acks with no payload
+		if (fec_data > 0 && in_buff_len >= HEADER_SIZE + FEC_REQUEST_LEN &&
+			in_buffer[7] == fec_data && in_buffer[8] == fec_parity){
+			fec_accepted = 1;
+		}
 		return 1;
 	}else if(flag == FLAG_DATA){
 		printf("Filename Ack lost, but received data");
@@ -167,13 +216,15 @@ RcopyState filename_exchange(int socketNum, struct sockaddr_in6 *server, char *a
 	// Setup the poll set and add our socket to it
 	setupPollSet();
 	addToPollSet(socketNum);
+	rtt_init(&rtt);
 
 	while (attempts <= 10){
-		send_filename(socketNum, server, atoi(argv[3]), atoi(argv[4]), argv[1]);
+		send_filename(socketNum, server, window_size, atoi(argv[4]), argv[1]);
 		printf("Attempt %d: Sent filename packet\n", attempts);
+		long sent_at = rtt_now_us();
 
-		// Wait for up to 1 second for a response
-		int readySocket = pollCall(1000); // 1000ms timeout
+		// Wait one retransmit timeout for a response, 1 second until there is a sample
+		int readySocket = pollCall(rtt_timeout_ms(&rtt));
 
 		if (readySocket == socketNum){ // Data available
 			int recvLen = safeRecvfrom(socketNum, buffer, MAX_PDU, 0, (struct sockaddr *)server, (int *)&serverLen);
@@ -181,10 +232,15 @@ RcopyState filename_exchange(int socketNum, struct sockaddr_in6 *server, char *a
 
 			// Process the respnse from server, check the flag.
 			if (1 == process_filename_response(buffer, recvLen)){
+				// Karn: after a resend the answer may be to either copy
+				if (attempts == 1){
+					rtt_sample(&rtt, rtt_now_us() - sent_at);
+				}
 				return RECEIVE_DATA; // Successful response, exit function
 			}
 		}else if (readySocket == -1){ // Timeout
 			printf("Timeout: No response received. Attempt: %d\n", attempts);
+			rtt_backoff(&rtt);
 		}else{
 			perror("Error with poll call\n");
 			exit(1);
@@ -200,32 +256,18 @@ RcopyState filename_exchange(int socketNum, struct sockaddr_in6 *server, char *a
   
 ////////////////////////////////Functions for Sending Packets///////////////////////////////
 
-/*This function sends an SREJ to the server*/
-void send_SREJ(int sockfd, struct sockaddr_in6 *server, uint32_t missing_seq){
-	uint8_t srej_packet[11];						// packet to be built
-	memset(srej_packet, '\0', sizeof(srej_packet)); // set buffer to null
-	socklen_t addr_len = sizeof(struct sockaddr_in6);
-
-	uint32_t net_seq_num = htonl(0);
-	uint32_t net_nack_seq = htonl(missing_seq);
-
-	// Add data
-	memcpy(srej_packet, &net_seq_num, 4);
-	srej_packet[6] = FLAG_SREJ;
-	memcpy(srej_packet + 7, &net_nack_seq, 4);
-
-	// Compute checksum and insert into (5-6)
-	memset(srej_packet + 4, 0, 2);
-	uint16_t checksum = in_cksum((unsigned short *)srej_packet, 11);
-	memcpy(srej_packet + 4, &checksum, 2);
-
-	// Send SREJ packet
-	safeSendto(sockfd, srej_packet, 11, 0, (struct sockaddr *)server, addr_len);
+/*Packets past the cumulative ack rcopy can take now: the window, cut
+  down to the free slots of the writer's ring when the disk is behind*/
+static int receive_window(void){
+	int space = writer != NULL ? disk_writer_space(writer) : window_size;
+	return space < window_size ? space : window_size;
 }
 
-/*This function sends an RR to the server. */
+/*This function sends an RR to the server. The receive window follows
+  the sequence number, a server that doesn't read it keeps the window
+  from the filename packet. */
 void send_rr(int sockfd, struct sockaddr_in6 *server, uint32_t next_expected_seq){
-	uint8_t rr_packet[11];					 // packet to be built
+	uint8_t rr_packet[15];					 // packet to be built
 	memset(rr_packet, 0, sizeof(rr_packet)); // set buffer to null
 	socklen_t addr_len = sizeof(struct sockaddr_in6);
 
@@ -237,73 +279,351 @@ void send_rr(int sockfd, struct sockaddr_in6 *server, uint32_t next_expected_seq
 	memcpy(rr_packet, &net_seq_num, 4);
 	rr_packet[6] = FLAG_RR;
 	memcpy(rr_packet + 7, &net_ack_seq, 4);
+	advertised_window = receive_window();
+	uint32_t net_window = htonl(advertised_window);
+	memcpy(rr_packet + 11, &net_window, 4);
 
 	// Compute checksum and insert into (5-6)
 	memset(rr_packet + 4, 0, 2);
-	uint16_t checksum = in_cksum((unsigned short *)rr_packet, 11);
+	uint16_t checksum = in_cksum((unsigned short *)rr_packet, 15);
 	memcpy(rr_packet + 4, &checksum, 2);
 
 	// Send RR packet
-	safeSendto(sockfd, rr_packet, 11, 0, (struct sockaddr *)server, addr_len);
+	safeSendto(sockfd, rr_packet, 15, 0, (struct sockaddr *)server, addr_len);
+
+	// It acknowledges everything held back
+	unacked = 0;
+	ack_due_ms = 0;
+}
+
+/*This function sends a SACK to the server: the cumulative RR followed by
+  a bitmap of the packets buffered past it, so every hole in the window
+  is reported at once. Bit i (most significant bit of each byte first)
+  is set when packet next_expected + 1 + i is buffered*/
+void send_sack(int sockfd, struct sockaddr_in6 *server, CircularBuffer *buffer){
+	uint8_t sack_packet[11 + SACK_MAX_BITS / 8];
+	memset(sack_packet, 0, sizeof(sack_packet));
+	socklen_t addr_len = sizeof(struct sockaddr_in6);
+
+	uint32_t net_seq_num = htonl(0);
+	uint32_t net_ack_seq = htonl(buffer->current);
+
+	// Set sequence number, flag, and cumulative RR sequence number
+	memcpy(sack_packet, &net_seq_num, 4);
+	sack_packet[6] = FLAG_SACK;
+	memcpy(sack_packet + 7, &net_ack_seq, 4);
+
+	// Only as many bytes as it takes to reach the highest buffered packet
+	int bits = buffer->highest - buffer->current;
+	if (bits > SACK_MAX_BITS){
+		bits = SACK_MAX_BITS;
+	}
+	for (int bit = 0; bit < bits; bit++){
+		int seq = buffer->current + 1 + bit;
+		BufferEntry *entry = &buffer->entries[buffer_index(buffer, seq)];
+		if (entry->valid_flag && entry->sequence_num == seq){
+			sack_packet[11 + bit / 8] |= 0x80 >> (bit % 8);
+		}
+	}
+	int packet_len = 11 + (bits + 7) / 8;
+
+	// Compute checksum and insert into (5-6)
+	memset(sack_packet + 4, 0, 2);
+	uint16_t checksum = in_cksum((unsigned short *)sack_packet, packet_len);
+	memcpy(sack_packet + 4, &checksum, 2);
+
+	// Send SACK packet
+	safeSendto(sockfd, sack_packet, packet_len, 0, (struct sockaddr *)server, addr_len);
+
+	// Its cumulative ack covers everything held back
+	unacked = 0;
+	ack_due_ms = 0;
+}
+
+/*Acknowledges a data packet that arrived in order. Every ack_every-th
+  one is acked at once, the others are held back RCOPY_ACK_DELAY_MS at
+  most so one RR covers several packets*/
+static void ack_inorder(int sockfd, struct sockaddr_in6 *server, uint32_t next_expected_seq){
+	if (++unacked >= ack_every){
+		send_rr(sockfd, server, next_expected_seq);
+		return;
+	}
+	if (ack_due_ms == 0){
+		ack_due_ms = rtt_now_us() / 1000 + RCOPY_ACK_DELAY_MS;
+	}
+}
+
+/*How long to wait for the next packet: what is left of the retransmit
+  timeout, cut short when a held back RR falls due first. While the
+  advertised window is closed down the writer is checked on as often*/
+static int ack_wait_ms(void){
+	long now_ms = rtt_now_us() / 1000;
+	int timeout = quiet_since_ms + rtt_timeout_ms(&rtt) - now_ms;
+
+	if (timeout < 0){
+		timeout = 0;
+	}
+	if (advertised_window < window_size && timeout > RCOPY_ACK_DELAY_MS){
+		timeout = RCOPY_ACK_DELAY_MS;
+	}
+	if (ack_due_ms > 0){
+		long left = ack_due_ms - now_ms;
+		if (left < timeout){
+			timeout = left > 0 ? (int)left : 0;
+		}
+	}
+	return timeout;
+}
+
+/*Sends the held back RR once its delay ran out.
+  Returns 1 if it did, the wait that ended was not a quiet server*/
+static int ack_expired(int sockfd, struct sockaddr_in6 *server, CircularBuffer *buffer){
+	if (ack_due_ms == 0 || rtt_now_us() / 1000 < ack_due_ms){
+		return 0;
+	}
+	send_rr(sockfd, server, buffer->current);
+	return 1;
+}
+
+/*Sends a window update once the writer has caught up by a quarter of
+  the window, or all the way, since the advertised window was cut.
+  Returns 1 if it did*/
+static int window_reopened(int sockfd, struct sockaddr_in6 *server, CircularBuffer *buffer){
+	int window = receive_window();
+
+	if (advertised_window >= window_size || (window < window_size && window < advertised_window + (window_size + 3) / 4)){
+		return 0;
+	}
+	printf("Writer caught up, window back to %d\n", window);
+	send_rr(sockfd, server, buffer->current);
+	return 1;
+}
+
+/*Feeds a received packet to the FEC decoder. Returns 1 for a parity
+  packet, which the receive states never see*/
+static int fec_absorb(uint8_t *in_packet, int recvLen){
+	uint8_t flag = in_packet[6];
+	uint32_t seq_num;
+
+	if (recvLen < HEADER_SIZE || in_cksum((unsigned short *)in_packet, recvLen) != 0){
+		return 0; // Dropped by the receive states
+	}
+	memcpy(&seq_num, in_packet, 4);
+	seq_num = ntohl(seq_num);
+	if (flag == FLAG_PARITY){
+		fec_decode_parity(fec, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE);
+		return 1;
+	}
+	if (flag == FLAG_DATA || flag == FLAG_RESENT_DATA || flag == FLAG_RESENT_TIMEOUT){
+		fec_decode_data(fec, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE);
+	}
+	return 0;
+}
+
+/*Hands out the next datagram from the receive batch. When the batch is
+  used up, waits up to timeout ms and drains everything queued on the
+  socket with one recvmmsg call. Packets rebuilt by FEC come first.
+  Returns NULL on timeout*/
+uint8_t *next_packet(int sockNum, struct sockaddr_in6 *server, RecvBatch *batch, int *recvLen, int timeout){
+	uint8_t *in_packet;
+
+	while (1){
+		if (fec != NULL && (in_packet = fec_decoder_next(fec, recvLen)) != NULL){
+			return in_packet;
+		}
+		while (recv_batch_pending(batch) == 0){
+			if (pollCall(timeout) != sockNum){
+				return NULL;
+			}
+			recv_batch_fill(batch, sockNum);
+		}
+
+		// The server is there. The backoff only starts over once the
+		// transfer moves on, see note_progress
+		quiet_timeouts = 0;
+		quiet_since_ms = rtt_now_us() / 1000;
+		in_packet = recv_batch_next(batch, recvLen, server);
+		if (fec == NULL || !fec_absorb(in_packet, *recvLen)){
+			return in_packet;
+		}
+	}
+}
+
+/*Called after every packet the receive states handle. Once the next
+  expected packet moves on, the timeouts start over from the plain
+  estimate. Duplicates and packets past a hole leave the backoff alone,
+  the server may still be backing off its own timer to mend the hole*/
+static void note_progress(CircularBuffer *buffer){
+	if (buffer->current == progress_seq){
+		return;
+	}
+	progress_seq = buffer->current;
+	progress_since_ms = rtt_now_us() / 1000;
+	rtt.backoff = 0;
+}
+
+/*Called when nothing arrived for a retransmit timeout. The last RR or
+  SACK may have been lost, so it is sent again with the timeout doubled.
+  Gives up after RCOPY_MAX_TIMEOUTS in a row, and only once the transfer
+  has not moved for RCOPY_GIVE_UP_MS either. A short RTT sample alone
+  would give up within a second, long before the server does*/
+void handle_quiet(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, RecvState state){
+	if (++quiet_timeouts >= RCOPY_MAX_TIMEOUTS && rtt_now_us() / 1000 - progress_since_ms >= RCOPY_GIVE_UP_MS){
+		printf("No progress after %d timeouts, giving up\n", quiet_timeouts);
+		exit(-1);
+	}
+	rtt_backoff(&rtt);
+	quiet_since_ms = rtt_now_us() / 1000;
+
+	printf("Timeout waiting for packet #%d, asking again\n", buffer->current);
+	if (state == BUFFER){
+		send_sack(sockNum, server, buffer);
+	}else{
+		send_rr(sockNum, server, buffer->current);
+	}
+}
+
+/*Called when a wait for the next packet ended with nothing. It was cut
+  short for a held back RR or a window update, or the server really
+  has been quiet for a retransmit timeout*/
+static void handle_wait(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, RecvState state){
+	if (ack_expired(sockNum, server, buffer) || window_reopened(sockNum, server, buffer)){
+		return;
+	}
+	if (rtt_now_us() / 1000 - quiet_since_ms < rtt_timeout_ms(&rtt)){
+		return;
+	}
+	// A server held back by a window the writer has not reopened yet is
+	// waiting on us, only repeat the window in case it was lost
+	if (advertised_window < window_size){
+		quiet_since_ms = rtt_now_us() / 1000;
+		send_rr(sockNum, server, buffer->current);
+		return;
+	}
+	handle_quiet(sockNum, server, buffer, state);
+}
+
+/*True for the packets the receive states take: data in any of its
+  forms and the EOF. A late filename ack also has sequence number 0 and
+  must not be written as the first chunk*/
+static int is_transfer_packet(const uint8_t *in_packet){
+	uint8_t flag = in_packet[6];
+	return flag == FLAG_DATA || flag == FLAG_RESENT_DATA || flag == FLAG_RESENT_TIMEOUT || flag == FLAG_EOF;
+}
+
+/*True when the hole at buffer->current is worth reporting after a
+  packet with seq_num arrived. With FEC the server sends a block's
+  parity right behind it, so a hole is only given up on once a packet
+  from a later block (or the EOF) shows the parity went by unused*/
+static int hole_is_lost(CircularBuffer *buffer, uint32_t seq_num, uint8_t flag){
+	if (fec == NULL || flag == FLAG_EOF){
+		return 1;
+	}
+	return fec_block_of(fec, seq_num) > fec_block_of(fec, buffer->current);
+}
+
+/*True when the chunk for the expected sequence number is buffered.
+  A slot can still hold a chunk from a duplicate of an earlier packet,
+  so the sequence number is checked too*/
+static int expected_is_buffered(CircularBuffer *buffer){
+	BufferEntry *entry = &buffer->entries[buffer_index(buffer, buffer->current)];
+	return entry->valid_flag && entry->sequence_num == buffer->current;
+}
+
+/*Queues the chunk the file is waiting for on the writer thread, at
+  its own offset with direct writes. Returns 0 when the writer's ring is
+  full, the packet is then dropped and comes again as a resend*/
+static int write_chunk(CircularBuffer *buffer, uint32_t seq_num, uint8_t *payload, int len){
+	off_t offset = direct_writes ? (off_t)seq_num * buffer->buffer_size : -1;
+	return disk_writer_push(writer, offset, payload, len);
+}
+
+/*Keeps a chunk that arrived past a hole until the hole is filled. With
+  direct writes it is queued for its offset in the file at once and the
+  buffer only notes that it arrived. Returns 0 when the window memory
+  cap or the writer's ring leaves no room*/
+static int store_chunk(CircularBuffer *buffer, uint32_t seq_num, uint8_t *payload, int len){
+	if (direct_writes){
+		if (!write_chunk(buffer, seq_num, payload, len)){
+			return 0;
+		}
+		buffer_mark(buffer, seq_num, len);
+		return 1;
+	}
+	return buffer_add(buffer, seq_num, payload, len);
 }
 
 RecvState handle_flush(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile) {
     while(1) {
-        // Calculate current index using modulo for circular buffer
+        // Calculate current index with the buffer's power of two mask
 		printf("buffering\n"); 
-        int current_index = buffer->current % buffer->size;
+        int current_index = buffer_index(buffer, buffer->current);
 
 		printf("CURRENT INDEX IN BUFFER: %d\n", current_index ); 
         
         // Exit loop if current entry is invalid
-        if (buffer->entries[current_index].valid_flag != 1) break;
+        if (!expected_is_buffered(buffer)) break;
 
-        // Write the actual buffered data
+        // Write the actual buffered data, a direct write already put it in place
 		printf("Writing in flush%d\n", buffer->current);
 
-		fwrite(buffer->entries[current_index].data, buffer->entries[current_index].data_len, 1, outFile);
+		if (!direct_writes && !write_chunk(buffer, buffer->current, buffer->entries[current_index].data, buffer->entries[current_index].data_len)){
+			break; // Stays buffered until handle_buffer sees the writer has room
+		}
 
         buffer->entries[current_index].valid_flag = 0;
+        buffer_release(buffer, buffer->current); // Chunk goes back to the pool
         
         // Move to next sequence number
         buffer->current++;
 
-        // Send RR for the NEXT expected sequence number
-        send_rr(sockNum, server, buffer->current);
-
 		printf("flushing!!!!!\n");
     }
 
-    // Check if we need to request missing packets
-    if (buffer->current < buffer->highest && buffer->entries[buffer->current % buffer->size].valid_flag == 0) {
-        send_SREJ(sockNum, server, buffer->current);
-		printf("Sending RR and SREJ in flush:%d \n", buffer->current); 
+    // Stopped by a full writer, the RR tells the server how far it got
+    if (expected_is_buffered(buffer)) {
 		send_rr(sockNum, server, buffer->current);
+		return BUFFER;
+    }
+
+    // Check if we need to request missing packets
+    if (buffer->current < buffer->highest && !expected_is_buffered(buffer)) {
+		printf("Sending SACK in flush:%d \n", buffer->current); 
+		if (hole_is_lost(buffer, buffer->highest, FLAG_DATA)){
+			send_sack(sockNum, server, buffer);
+		}else{
+			send_rr(sockNum, server, buffer->current);
+		}
 
         return BUFFER;
     }
 
-    // Return to normal processing if we're caught up
+    // One cumulative RR for everything flushed, then back to normal processing
+    send_rr(sockNum, server, buffer->current);
     return INORDER;
 }
 
-RecvState handle_buffer(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile){
+RecvState handle_buffer(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile, RecvBatch *batch){
 	//Init for FSM
 	int recvLen = 0; 
-	int socketReady; 
-	uint8_t in_packet[MAX_PDU]; //Packet to be received
-	memset(in_packet, 0, sizeof(in_packet)); //Zero out the packet
-	socklen_t addr_len = sizeof(server);
-
-	socketReady = pollCall(10000);
-	if(socketReady == sockNum){
-		recvLen = safeRecvfrom(sockNum, in_packet, MAX_PDU, 0, (struct sockaddr *)server, (int *)&addr_len); //Recv data
+	uint8_t *in_packet; //Packet to be received
+
+	// A flush the writer's ring cut short goes on once it has room
+	if (expected_is_buffered(buffer) && disk_writer_space(writer) > 0){
+		return FLUSH;
+	}
+
+	in_packet = next_packet(sockNum, server, batch, &recvLen, ack_wait_ms());
+	if(in_packet != NULL){
 			
 		//Check the checksum
 		if (in_cksum((unsigned short *)in_packet, recvLen) != 0){
 				printf("Checksum error, packet will be dropped\n");
 				return BUFFER; 
 		}
+		if (!is_transfer_packet(in_packet)){
+			return BUFFER;
+		}
 
 		//Get sequence number
 		// Get the sequence number
@@ -325,40 +645,52 @@ RecvState handle_buffer(int sockNum, struct sockaddr_in6 *server, CircularBuffer
 		//Algorithm for determining the next state
 		if(seq_num == buffer->current){ //Move to flush state; 
 			printf("Writing in buffer%d\n", buffer->current);
-			fwrite(in_packet + HEADER_SIZE , recvLen - HEADER_SIZE, 1, outFile); // Write to file go to inorder 
-			fflush(outFile);
+			if (!write_chunk(buffer, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE)){ // Write to file go to inorder 
+				printf("Writer full, dropping packet #%d\n", seq_num);
+				send_rr(sockNum, server, buffer->current);
+				return BUFFER;
+			}
+			buffer_release(buffer, seq_num); // A duplicate may have been buffered
 			buffer->current++;
 			return FLUSH; 
 		}else if(seq_num > buffer->current){ // return out of order and buffer
-			buffer_add(buffer, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE ); 
-			buffer->highest = seq_num;
+			if (!store_chunk(buffer, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE)){
+				printf("No room for packet #%d, dropping it\n", seq_num);
+			}
+			if ((int)seq_num > buffer->highest){
+				buffer->highest = seq_num;
+			}
+			// Acked like an in order packet would be, a hole whose resend
+			// was lost shows up again a round trip later
+			if (hole_is_lost(buffer, seq_num, in_packet[6])){
+				send_sack(sockNum, server, buffer);
+			}
 			return BUFFER;
 		}else if(seq_num < buffer->current){
 			send_rr(sockNum,server,buffer->current);
 		}
-	}else if(socketReady == -1){ 
-		exit(-1); 
+	}else{
+		handle_wait(sockNum, server, buffer, BUFFER);
 	}
 	return BUFFER; 
 }
 
-RecvState handle_inorder(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile){
+RecvState handle_inorder(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile, RecvBatch *batch){
 	//Init for FSM
 	int recvLen = 0; 
-	int socketReady; 
-	uint8_t in_packet[MAX_PDU]; //Packet to be received
-	memset(in_packet, 0, sizeof(in_packet)); //Zero out the packet
-	socklen_t addr_len = sizeof(server);
-
-	socketReady = pollCall(10000);
-	if(socketReady == sockNum){
-		recvLen = safeRecvfrom(sockNum, in_packet, MAX_PDU, 0, (struct sockaddr *)server, (int *)&addr_len); //Recv data
+	uint8_t *in_packet; //Packet to be received
+
+	in_packet = next_packet(sockNum, server, batch, &recvLen, ack_wait_ms());
+	if(in_packet != NULL){
 			
 		//Check the checksum
 		if (in_cksum((unsigned short *)in_packet, recvLen) != 0){
 				printf("Checksum error, packet will be dropped\n");
 				return INORDER; 
 		}
+		if (!is_transfer_packet(in_packet)){
+			return INORDER;
+		}
 		//Get sequence number
 		// Get the sequence number
 		uint32_t seq_num;
@@ -381,29 +713,49 @@ RecvState handle_inorder(int sockNum, struct sockaddr_in6 *server, CircularBuffe
 
 		if( seq_num == buffer->current){
 			printf("Writing inorder %d\n", buffer->current);
-			fwrite(in_packet + HEADER_SIZE , recvLen - HEADER_SIZE, 1, outFile); // Write to file go to inorder
-			fflush(outFile);
+			if (!write_chunk(buffer, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE)){ // Write to file go to inorder
+				printf("Writer full, dropping packet #%d\n", seq_num);
+				send_rr(sockNum, server, buffer->current);
+				return INORDER;
+			}
+			buffer_release(buffer, seq_num); // A duplicate may have been buffered
 			buffer->highest = buffer->current; 
 			buffer->current++;
-			send_rr(sockNum,server, buffer->current); 
+			// Packets past a hole the server filled by timeout are waiting,
+			// the flush acks them all at once
+			if (expected_is_buffered(buffer)){
+				return FLUSH;
+			}
+			// Plain data can share an RR, a resend or the EOF is acked at once
+			if (in_packet[6] == FLAG_DATA){
+				ack_inorder(sockNum, server, buffer->current);
+			}else{
+				send_rr(sockNum, server, buffer->current);
+			}
 			printf("Sending RR and SREJ in buffer:%d \n", buffer->current); 
 			return INORDER; 
 		}else if(seq_num > buffer->current){ // return out of order and buffer
-			send_SREJ(sockNum, server, buffer->current); 
 			printf("Added to buffer======%d", seq_num);
-			buffer_add(buffer, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE ); 
-			buffer->highest = seq_num;
+			if (!store_chunk(buffer, seq_num, in_packet + HEADER_SIZE, recvLen - HEADER_SIZE)){
+				printf("No room for packet #%d, dropping it\n", seq_num);
+			}
+			if ((int)seq_num > buffer->highest){
+				buffer->highest = seq_num;
+			}
+			if (hole_is_lost(buffer, seq_num, in_packet[6])){
+				send_sack(sockNum, server, buffer);
+			}
 			return BUFFER;
 		}else if(seq_num < buffer->current){
 			send_rr(sockNum,server,buffer->current);
 		}
-	}else if(socketReady == -1){ 
-		exit(-1); 
+	}else{
+		handle_wait(sockNum, server, buffer, INORDER);
 	}
 	return INORDER; 
 }
 
-RecvState receive_data_fsm(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile, RecvState current){
+RecvState receive_data_fsm(int sockNum, struct sockaddr_in6 *server, CircularBuffer *buffer, FILE *outFile, RecvState current, RecvBatch *batch){
 	printf("~~~~~Expected: %d  ~~~~~~~ \n", buffer->current); 	
 	printf("~~~~~~~~~~~Highest: %d, Current: %d, Lowest: %d~~~~~~~~~~~~~~~~~\n", buffer->highest, buffer->current, buffer->lowest);
 
@@ -411,7 +763,7 @@ RecvState receive_data_fsm(int sockNum, struct sockaddr_in6 *server, CircularBuf
 	switch(current){
 			case INORDER: 
 				printf("INORDER:\n");
-				next = handle_inorder(sockNum, server, buffer, outFile);
+				next = handle_inorder(sockNum, server, buffer, outFile, batch);
 				if (next == EXIT) {
 					printf("Exiting from INORDER\n");
 					return EXIT; 
@@ -419,7 +771,7 @@ RecvState receive_data_fsm(int sockNum, struct sockaddr_in6 *server, CircularBuf
 				break;
 			case BUFFER:
 				printf("BUFFERING:\n");
-				next = handle_buffer(sockNum, server, buffer, outFile);
+				next = handle_buffer(sockNum, server, buffer, outFile, batch);
 				if (next == EXIT) {
 					printf("Exiting from BUFFER\n");
 					return EXIT; 
@@ -434,10 +786,12 @@ RecvState receive_data_fsm(int sockNum, struct sockaddr_in6 *server, CircularBuf
 				}
 				break; 
 			case EXIT: 
+				next = EXIT;
 				break;
 			default:
 				next = EXIT; 
 	}
+	note_progress(buffer);
 	return next;
 }
 
@@ -447,8 +801,17 @@ void rcopy_FSM(int sockfd, struct sockaddr_in6 *server, char *argv[]){
 	RcopyState state = SEND_FILENAME;
 
 	// Initiate buffer
+	window_size = atoi(argv[3]);
+	// The writer's ring caps the window rcopy can advertise, so the
+	// server is told the smaller window from the filename packet on
+	if (window_size > DISK_WRITER_MAX_SLOTS){
+		printf("Window size %d reduced to %d, the most chunks the disk writer queues\n", window_size, DISK_WRITER_MAX_SLOTS);
+		window_size = DISK_WRITER_MAX_SLOTS;
+	}
+	advertised_window = window_size;
 	CircularBuffer *buffer = (CircularBuffer *)malloc(sizeof(CircularBuffer));
-	buffer_init(buffer, atoi(argv[3]), atoi(argv[4]), 0);
+	buffer_init(buffer, window_size, atoi(argv[4]), 0);
+	RecvBatch *batch = recv_batch_create();
 
 	//Init for recvFSM
 	RecvState currentRecvState = INORDER; 
@@ -473,11 +836,18 @@ void rcopy_FSM(int sockfd, struct sockaddr_in6 *server, char *argv[]){
 				buffer_free(buffer); 
 				break;
 			}
+			if (fec_accepted){
+				fec = fec_decoder_create(fec_data, fec_parity, atoi(argv[4]), window_size);
+			}
+			writer = disk_writer_create(outFile, atoi(argv[4]), window_size);
+			quiet_since_ms = rtt_now_us() / 1000;
+			progress_since_ms = quiet_since_ms;
 			printf("File Ok state reached\n");
 			break;
 		case RECEIVE_DATA:
-			currentRecvState = receive_data_fsm(sockfd,server, buffer, outFile, currentRecvState);
+			currentRecvState = receive_data_fsm(sockfd,server, buffer, outFile, currentRecvState, batch);
 			if(currentRecvState == EXIT){
+				disk_writer_close(writer);
 				fflush(outFile);
 				fclose(outFile);
 				buffer_free(buffer); 
@@ -492,6 +862,37 @@ void rcopy_FSM(int sockfd, struct sockaddr_in6 *server, char *argv[]){
 			break;
 		}
 	}
+	recv_batch_free(batch);
+	if (fec != NULL){
+		fec_decoder_free(fec);
+	}
+}
+
+/*Parses the options in front of the positional arguments.
+  Returns how many argv entries they took*/
+int checkOptions(int argc, char *argv[])
+{
+	int option = 0;
+
+	while ((option = getopt(argc, argv, "HM:bF:a:w")) != -1){
+		if (option == 'b'){
+			transfer_class = TRANSFER_BACKGROUND;
+		}else if (option == 'F' && sscanf(optarg, "%d:%d", &fec_data, &fec_parity) == 2 && fec_valid_ratio(fec_data, fec_parity)){
+			printf("FEC: asking for %d parity packets per %d data packets\n", fec_parity, fec_data);
+		}else if (option == 'a' && atoi(optarg) > 0){
+			ack_every = atoi(optarg);
+		}else if (option == 'w'){
+			direct_writes = 1;
+		}else if (option == 'H'){
+			buffer_set_huge_pages(true);
+		}else if (option == 'M' && atol(optarg) >= 0){
+			buffer_set_memory_cap((size_t)atol(optarg) * 1024 * 1024);
+		}else{
+			printf("usage: %s [-a acks-every] [-b] [-F data:parity] [-H] [-M cap-MB] [-w] from-filename to-filename window-size buffer-size error-rate remote-machine remote-number \n", argv[0]);
+			exit(1);
+		}
+	}
+	return optind - 1;
 }
 
 int checkArgs(int argc, char *argv[])
@@ -500,7 +901,7 @@ int checkArgs(int argc, char *argv[])
 
 	/* check command line arguments  */
 	if (argc != 8){
-		printf("usage: %s from-filename to-filename window-size buffer-size error-rate remote-machine remote-number \n", argv[0]);
+		printf("usage: %s [-a acks-every] [-b] [-F data:parity] [-H] [-M cap-MB] [-w] from-filename to-filename window-size buffer-size error-rate remote-machine remote-number \n", argv[0]);
 		exit(1);
 	}
 
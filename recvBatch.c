@@ -0,0 +1,67 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "recvBatch.h"
+#include "safeUtil.h"
+
+RecvBatch *recv_batch_create(void){
+    RecvBatch *batch = (RecvBatch *)sCalloc(1, sizeof(RecvBatch));
+    batch->packets = sCalloc(RECV_BATCH_MAX, MAX_PDU);
+    batch->count = 0;
+    batch->next = 0;
+    return batch;
+}
+
+/*Drains every datagram already queued on the socket (up to
+  RECV_BATCH_MAX) with one recvmmsg call. Only call this once poll
+  says the socket is readable or it returns 0 straight away.
+  Returns the number of datagrams received*/
+int recv_batch_fill(RecvBatch *batch, int socketNum){
+    struct mmsghdr msgs[RECV_BATCH_MAX];
+    struct iovec iov[RECV_BATCH_MAX];
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < RECV_BATCH_MAX; i++){
+        iov[i].iov_base = batch->packets[i];
+        iov[i].iov_len = MAX_PDU;
+        msgs[i].msg_hdr.msg_name = &batch->from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = safeRecvmmsg(socketNum, msgs, RECV_BATCH_MAX, MSG_DONTWAIT);
+    for (int i = 0; i < received; i++){
+        batch->packet_len[i] = msgs[i].msg_len;
+    }
+
+    batch->count = received;
+    batch->next = 0;
+    return received;
+}
+
+/*Returns how many received datagrams have not been handed out yet*/
+int recv_batch_pending(RecvBatch *batch){
+    return batch->count - batch->next;
+}
+
+/*Hands out the next datagram of the batch and its sender.
+  Returns NULL when the batch is used up*/
+uint8_t *recv_batch_next(RecvBatch *batch, int *packet_len, struct sockaddr_in6 *from){
+    if (batch->next >= batch->count){
+        return NULL;
+    }
+
+    int slot = batch->next++;
+    *packet_len = batch->packet_len[slot];
+    if (from != NULL){
+        memcpy(from, &batch->from[slot], sizeof(struct sockaddr_in6));
+    }
+    return batch->packets[slot];
+}
+
+void recv_batch_free(RecvBatch *batch){
+    free(batch->packets);
+    free(batch);
+}
@@ -0,0 +1,27 @@
+#ifndef RECV_BATCH_H
+#define RECV_BATCH_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "communication.h"
+
+// Most datagrams pulled off the socket in one recvmmsg call
+#define RECV_BATCH_MAX 64
+
+/*Datagrams drained from the socket by one recvmmsg call.
+  They are handed out one at a time with recv_batch_next.*/
+typedef struct {
+    uint8_t (*packets)[MAX_PDU];              // RECV_BATCH_MAX receive buffers
+    int packet_len[RECV_BATCH_MAX];
+    struct sockaddr_in6 from[RECV_BATCH_MAX]; // Sender of each datagram
+    int count;                                // Datagrams in the batch
+    int next;                                 // Next one to hand out
+} RecvBatch;
+
+RecvBatch *recv_batch_create(void);
+int recv_batch_fill(RecvBatch *batch, int socketNum);
+int recv_batch_pending(RecvBatch *batch);
+uint8_t *recv_batch_next(RecvBatch *batch, int *packet_len, struct sockaddr_in6 *from);
+void recv_batch_free(RecvBatch *batch);
+
+#endif
@@ -0,0 +1,70 @@
+#include <time.h>
+
+#include "rtt.h"
+
+// Backoff stops doubling once the timeout is past RTT_MAX_RTO_MS anyway
+#define RTT_MAX_BACKOFF 16
+
+void rtt_init(RttEstimator *rtt){
+    rtt->srtt_us = 0;
+    rtt->rttvar_us = 0;
+    rtt->rto_us = RTT_INITIAL_RTO_MS * 1000L;
+    rtt->backoff = 0;
+    rtt->has_sample = 0;
+}
+
+/*Folds one round trip measurement into the estimate. A sample means
+  the peer is answering again, so the backoff is reset*/
+void rtt_sample(RttEstimator *rtt, long sample_us){
+    if (sample_us < 0){
+        return;
+    }
+
+    if (!rtt->has_sample){
+        rtt->srtt_us = sample_us;
+        rtt->rttvar_us = sample_us / 2;
+        rtt->has_sample = 1;
+    }else{
+        long error = rtt->srtt_us - sample_us;
+        if (error < 0){
+            error = -error;
+        }
+        // rttvar = 3/4 rttvar + 1/4 |srtt - sample|, srtt = 7/8 srtt + 1/8 sample
+        rtt->rttvar_us += (error - rtt->rttvar_us) / 4;
+        rtt->srtt_us += (sample_us - rtt->srtt_us) / 8;
+    }
+
+    long variance = 4 * rtt->rttvar_us;
+    if (variance < RTT_CLOCK_GRANULARITY_US){
+        variance = RTT_CLOCK_GRANULARITY_US;
+    }
+    rtt->rto_us = rtt->srtt_us + variance;
+    rtt->backoff = 0;
+}
+
+/*Called on every timeout, the next one waits twice as long*/
+void rtt_backoff(RttEstimator *rtt){
+    if (rtt->backoff < RTT_MAX_BACKOFF){
+        rtt->backoff++;
+    }
+}
+
+/*Milliseconds to wait before retransmitting, backoff included*/
+int rtt_timeout_ms(const RttEstimator *rtt){
+    long timeout = (rtt->rto_us << rtt->backoff) / 1000;
+
+    if (timeout < RTT_MIN_RTO_MS){
+        timeout = RTT_MIN_RTO_MS;
+    }
+    if (timeout > RTT_MAX_RTO_MS){
+        timeout = RTT_MAX_RTO_MS;
+    }
+    return (int)timeout;
+}
+
+// Monotonic clock in microseconds for round trip samples
+long rtt_now_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000L;
+}
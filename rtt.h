@@ -0,0 +1,28 @@
+#ifndef RTT_H
+#define RTT_H
+
+// Timeout before there is any round trip sample
+#define RTT_INITIAL_RTO_MS 1000
+// Bounds on the retransmit timeout, backoff included
+#define RTT_MIN_RTO_MS 10
+#define RTT_MAX_RTO_MS 4000
+// Timer granularity added to the variance term
+#define RTT_CLOCK_GRANULARITY_US 1000
+
+/*Jacobson/Karels round trip estimator (RFC 6298). Only send a sample
+  for a packet that was not retransmitted (Karn's algorithm)*/
+typedef struct {
+    long srtt_us;   // Smoothed round trip time
+    long rttvar_us; // Smoothed mean deviation of the round trip time
+    long rto_us;    // srtt + 4 * rttvar, before backoff
+    int backoff;    // Timeouts since the last sample, each doubles the timeout
+    int has_sample;
+} RttEstimator;
+
+void rtt_init(RttEstimator *rtt);
+void rtt_sample(RttEstimator *rtt, long sample_us);
+void rtt_backoff(RttEstimator *rtt);
+int rtt_timeout_ms(const RttEstimator *rtt);
+long rtt_now_us(void);
+
+#endif
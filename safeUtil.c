@@ -5,10 +5,12 @@
 // Put in system calls with error checking
 // keep the function paramaters same as system call
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
 
 #include "safeUtil.h"
 
@@ -40,6 +42,44 @@ int safeSendto(int socketNum, void *buf, int len, int flags, struct sockaddr *de
     return returnValue;
 }
 
+// sendmmsg() can stop part way through the vector, keep going until
+// every message is handed to the kernel
+int safeSendmmsg(int socketNum, struct mmsghdr *msgs, int vlen, int flags)
+{
+	int sent = 0;
+	int returnValue = 0;
+
+	while (sent < vlen)
+	{
+		if ((returnValue = sendmmsg(socketNum, msgs + sent, (unsigned int) (vlen - sent), flags)) < 0)
+		{
+			perror("sendmmsg: ");
+			exit(-1);
+		}
+		sent += returnValue;
+	}
+
+	return sent;
+}
+
+// Returns 0 instead of failing when a non blocking call finds
+// nothing queued
+int safeRecvmmsg(int socketNum, struct mmsghdr *msgs, int vlen, int flags)
+{
+	int returnValue = 0;
+	if ((returnValue = recvmmsg(socketNum, msgs, (unsigned int) vlen, flags, NULL)) < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return 0;
+		}
+		perror("recvmmsg: ");
+		exit(-1);
+	}
+
+	return returnValue;
+}
+
 int safeRecv(int socketNum, void * buf, int len, int flags)
 {
 	int returnValue = 0;
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "sendBatch.h"
+#include "safeUtil.h"
+
+// The cpe464 library keeps its error emulation state in globals
+static pthread_mutex_t emulation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Creates an empty batch.
+  emulate_errors should be set when sendErr_init was given a non zero
+  error rate, sendmmsg skips the library so those packets go out one
+  at a time through safeSendto instead.*/
+SendBatch *send_batch_create(int emulate_errors){
+    SendBatch *batch = (SendBatch *)sCalloc(1, sizeof(SendBatch));
+    batch->packets = sCalloc(SEND_BATCH_MAX, MAX_PDU);
+    batch->count = 0;
+    batch->emulate_errors = emulate_errors;
+    return batch;
+}
+
+/*Builds a packet into the next free slot of the batch.
+  Returns the number of queued packets, the caller has to flush
+  once this reaches SEND_BATCH_MAX*/
+int send_batch_add(SendBatch *batch, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size){
+    if (batch->count == SEND_BATCH_MAX){
+        fprintf(stderr, "Send batch full, dropping packet #%u\n", seq_num);
+        return batch->count;
+    }
+
+    int slot = batch->count;
+    batch->packet_len[slot] = build_packet(batch->packets[slot], seq_num, flag, payload, payload_size);
+    batch->payload[slot] = NULL;
+    batch->count++;
+
+    return batch->count;
+}
+
+/*Like send_batch_add but only the header is built, the payload is sent
+  straight from where it is (a file mapping) with a second iovec.
+  payload must stay valid until the batch is flushed.
+  With error emulation the packet is still copied, sendtoErr needs it
+  in one piece*/
+int send_batch_add_ref(SendBatch *batch, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size){
+    if (batch->emulate_errors || payload == NULL || payload_size == 0){
+        return send_batch_add(batch, seq_num, flag, payload, payload_size);
+    }
+
+    if (batch->count == SEND_BATCH_MAX){
+        fprintf(stderr, "Send batch full, dropping packet #%u\n", seq_num);
+        return batch->count;
+    }
+
+    int slot = batch->count;
+    batch->packet_len[slot] = build_header(batch->packets[slot], seq_num, flag, payload, payload_size);
+    batch->payload[slot] = payload;
+    batch->count++;
+
+    return batch->count;
+}
+
+/*Like send_batch_add_ref for a payload whose sum is already known,
+  so neither the header nor the payload needs a pass over the data.
+  payload must stay valid until the batch is flushed*/
+int send_batch_add_summed(SendBatch *batch, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size, uint16_t payload_sum){
+    uint8_t header[HEADER_SIZE];
+
+    build_header_summed(header, seq_num, flag, payload_size, payload_sum);
+    return send_batch_add_built(batch, header, payload, payload_size);
+}
+
+/*Queues a packet whose header (checksum included) is already built,
+  for retransmits. Nothing is summed, and the payload is only copied
+  when error emulation needs the packet in one piece*/
+int send_batch_add_built(SendBatch *batch, uint8_t *header, uint8_t *payload, int payload_size){
+    if (batch->count == SEND_BATCH_MAX){
+        fprintf(stderr, "Send batch full, dropping a built packet\n");
+        return batch->count;
+    }
+
+    int slot = batch->count;
+    memcpy(batch->packets[slot], header, HEADER_SIZE);
+    batch->packet_len[slot] = HEADER_SIZE + payload_size;
+    if (batch->emulate_errors){
+        memcpy(batch->packets[slot] + HEADER_SIZE, payload, payload_size);
+        batch->payload[slot] = NULL;
+    }else{
+        batch->payload[slot] = payload;
+    }
+    batch->count++;
+
+    return batch->count;
+}
+
+/*Header of the packet queued last, so callers can keep a copy of it*/
+uint8_t *send_batch_last_header(SendBatch *batch){
+    return batch->packets[batch->count - 1];
+}
+
+/*Sends every queued packet to the client and empties the batch.
+  Returns the number of packets sent*/
+int send_batch_flush(SendBatch *batch, int socketNum, struct sockaddr_in6 *client){
+    int sent = batch->count;
+    int addr_len = sizeof(struct sockaddr_in6);
+
+    if (sent == 0){
+        return 0;
+    }
+
+    if (batch->emulate_errors){
+        pthread_mutex_lock(&emulation_lock);
+        for (int i = 0; i < sent; i++){
+            safeSendto(socketNum, batch->packets[i], batch->packet_len[i], 0, (struct sockaddr *)client, addr_len);
+        }
+        pthread_mutex_unlock(&emulation_lock);
+    }else{
+        struct mmsghdr msgs[SEND_BATCH_MAX];
+        struct iovec iov[SEND_BATCH_MAX][2];
+        memset(msgs, 0, sizeof(struct mmsghdr) * sent);
+
+        for (int i = 0; i < sent; i++){
+            iov[i][0].iov_base = batch->packets[i];
+            iov[i][0].iov_len = batch->packet_len[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            if (batch->payload[i] != NULL){
+                // Header from the batch, payload from the caller's memory
+                iov[i][0].iov_len = HEADER_SIZE;
+                iov[i][1].iov_base = batch->payload[i];
+                iov[i][1].iov_len = batch->packet_len[i] - HEADER_SIZE;
+                msgs[i].msg_hdr.msg_iovlen = 2;
+            }
+            msgs[i].msg_hdr.msg_name = client;
+            msgs[i].msg_hdr.msg_namelen = addr_len;
+            msgs[i].msg_hdr.msg_iov = iov[i];
+        }
+        safeSendmmsg(socketNum, msgs, sent, 0);
+    }
+
+    batch->count = 0;
+    return sent;
+}
+
+void send_batch_free(SendBatch *batch){
+    free(batch->packets);
+    free(batch);
+}
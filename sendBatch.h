@@ -0,0 +1,31 @@
+#ifndef SEND_BATCH_H
+#define SEND_BATCH_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "communication.h"
+
+// Most packets handed to the kernel in one sendmmsg call
+#define SEND_BATCH_MAX 64
+
+/*Packets waiting to be sent in a single sendmmsg call.
+  Every packet in a batch goes to the same client.*/
+typedef struct {
+    uint8_t (*packets)[MAX_PDU]; // Built packets, SEND_BATCH_MAX of them
+    int packet_len[SEND_BATCH_MAX];
+    uint8_t *payload[SEND_BATCH_MAX]; // Payload left in place, NULL when it was copied into packets
+    int count;                   // Number of queued packets
+    int emulate_errors;          // Send one by one through sendtoErr
+} SendBatch;
+
+SendBatch *send_batch_create(int emulate_errors);
+int send_batch_add(SendBatch *batch, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size);
+int send_batch_add_ref(SendBatch *batch, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size);
+int send_batch_add_summed(SendBatch *batch, uint32_t seq_num, uint8_t flag, uint8_t *payload, int payload_size, uint16_t payload_sum);
+// A payload queued by reference must not be released until the batch is flushed
+int send_batch_add_built(SendBatch *batch, uint8_t *header, uint8_t *payload, int payload_size);
+uint8_t *send_batch_last_header(SendBatch *batch);
+int send_batch_flush(SendBatch *batch, int socketNum, struct sockaddr_in6 *client);
+void send_batch_free(SendBatch *batch);
+
+#endif
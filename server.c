@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -18,20 +20,27 @@
 #include "cpe464.h"
 #include "buffer.h"
 #include "pollLib.h"
+#include "sendBatch.h"
+#include "recvBatch.h"
+#include "session.h"
+#include "eventServer.h"
+#include "chunkCache.h"
+
+typedef enum
+{
+    MODE_FORK,  // One child process per transfer
+    MODE_EVENT,  // Every transfer in this process on one epoll loop
+    MODE_THREADS // One epoll loop per worker thread on SO_REUSEPORT sockets
+} ServerMode;
 
 float ERROR_RATE = 0.0;
+ServerMode SERVER_MODE = MODE_FORK;
+int WORKER_COUNT = 0; // 0 means one per online core
+ServerOptions SERVER_OPTIONS;
 
 void server_FSM(int socketNum);
 int checkArgs(int argc, char *argv[]);
 
-typedef enum
-{
-    DONE,
-    FILENAME_ACK,
-    SEND_DATA,
-    WAIT_EOF_ACK 
-} ServerState;
-
 int main(int argc, char *argv[])
 {
 
@@ -40,51 +49,39 @@ int main(int argc, char *argv[])
 
     portNumber = checkArgs(argc, argv);
 
-    // Get socket number and add to poll set.
+    if (SERVER_MODE == MODE_THREADS)
+    {
+        //Initiate trouble maker once, every worker shares it
+        sendErr_init(ERROR_RATE, 1, 1, 1, 1);
+        event_server_run_workers(portNumber, WORKER_COUNT > 0 ? WORKER_COUNT : get_nprocs(), &SERVER_OPTIONS);
+        return 0;
+    }
+
+    // Get socket number
     socketNum = udpServerSetup(portNumber);
-    setupPollSet();
-    addToPollSet(socketNum);
 
-    server_FSM(socketNum);
+    if (SERVER_MODE == MODE_EVENT)
+    {
+        //Initiate trouble maker once, every session shares it
+        sendErr_init(ERROR_RATE, 1, 1, 1, 1);
+        event_server_run(socketNum, &SERVER_OPTIONS);
+    }
+    else
+    {
+        // Add to poll set.
+        setupPollSet();
+        addToPollSet(socketNum);
+        server_FSM(socketNum);
+    }
 
     close(socketNum);
 
     return 0;
 }
 
-// This function sends a filename ack
-void send_filename_ack(int socketNum, struct sockaddr_in6 *client){
-    uint8_t out_packet[7]; // Packet to be constructed
-    int packet_len = 0;    // Packet size
-
-    // Build packet
-    packet_len = build_packet(out_packet, 0, FLAG_FILENAME_ACK, NULL, 0);
-
-    // Calculate addr_len for safeSendTo
-    int addr_len = sizeof(struct sockaddr_in6);
-
-    // Send to client socket
-    safeSendto(socketNum, out_packet, packet_len, 0, (struct sockaddr *)client, addr_len);
-}
-
-// This function sends a filename_error
-void send_filename_error(int socketNum, struct sockaddr_in6 *client){
-    uint8_t out_packet[7]; // Packet to be constructed
-    int packet_len = 0;    // Packet size
-
-    // Build packetwit
-    packet_len = build_packet(out_packet, 0, FLAG_FILENAME_ERROR, NULL, 0);
-
-    // Calculate addr_len for safeSendTo
-    int addr_len = sizeof(struct sockaddr_in6);
-
-    // Send to client socket
-    safeSendto(socketNum, out_packet, packet_len, 0, (struct sockaddr *)client, addr_len);
-}
-
-/*This function processes the filename packet from rcopy.
+/*This function waits for the filename packet from rcopy.
   It sets the filename, window-size, and buffer-size*/
-  FILE *processFilenameAck(int socketNum, struct sockaddr_in6 *client, int *window_size, int *buffer_size) {
+  FILE *processFilenameAck(SendBatch *batch, int socketNum, struct sockaddr_in6 *client, TransferRequest *request) {
     uint8_t buffer[MAX_PDU];  
     socklen_t addr_len = sizeof(struct sockaddr_in6);
     int attempts = 0;
@@ -99,261 +96,51 @@ void send_filename_error(int socketNum, struct sockaddr_in6 *client){
             continue;  // Retry if reception fails
         }
 
-        // Verify checksum
-        if (in_cksum((unsigned short *)buffer, dataLen) != 0) {
-            fprintf(stderr, "Checksum verification failed (Attempt %d/10)\n", attempts + 1);
-            attempts++;
-            continue;  // Retry if checksum fails
-        }
-
-        printf("Checksum Passed!\n");
-
-        // Extract window size and buffer size
-        *window_size = ntohl(*(uint32_t *)(buffer + 7));
-        *buffer_size = ntohl(*(uint32_t *)(buffer + 11));
-
-        // Extract filename safely
-        char filename[101] = {0};
-        int filename_len = dataLen - 15;
-        if (filename_len > 100) {
-            filename_len = 100;
-        }
-        strncpy(filename, (char *)(buffer + 15), filename_len);
-        filename[filename_len] = '\0';  // Ensure null termination
-
-        // printf("Filename requested: %s\n", filename);
-        // printf("Window Size: %u, Buffer Size: %u\n", window_size, buffer_size);
-
-        // Attempt to open the requested file
-        FILE *file = fopen(filename, "rb");
-        if (!file) {
-            perror("Failed to open file");
-            send_filename_error(socketNum, client);
-            return NULL;
+        FILE *file = process_filename_packet(batch, socketNum, client, buffer, dataLen, request);
+        if (file != NULL) {
+            return file;
         }
-
-        // Send acknowledgment after successfully opening the file
-        send_filename_ack(socketNum, client);
-        return file;
+        attempts++;
     }
     printf("Error: Max attempts (10) reached. Failed to receive valid filename packet.\n");
     return NULL;  // Return NULL after 10 failed attempts
 }
 
-/*Returns -1 when EOF*/
-int read_file_to_buffer(CircularBuffer *window, FILE *export_file){
-    size_t bytesRead; // Bytes read from fread
-
-    uint8_t tempBuff[window->buffer_size]; //
-    memset(tempBuff, 0, window->buffer_size);  // Clear buffer
-
-    int sequence_num = window->current;
-    int index = sequence_num % window->size;
-
-    bytesRead = fread(tempBuff, 1, window->buffer_size, export_file);
-
-    if (bytesRead == 0){
-        // switch state to eof
-        printf("END OF FILE!!!!!!!!!!!\n");
-        return -1; // End of file
-    }
-
-    printf("----------------Seq Num: %d---------------------\n", sequence_num);
-    printf("Highest: %d, Current: %d, Lowest: %d\n", window->highest, window->current, window->lowest);
-    printf("\n");
-
-    // Add the data to window data structure :)
-    buffer_add(window, sequence_num, tempBuff, bytesRead);
-    window->entries[index].data_len = bytesRead; //Add length of data to the index 
-
-
-    printf("Data to be sent: %s\n", window->entries[index].data);
-
-    return bytesRead;
-}
-
-// Function for sending data
-void send_data(int socketNum, struct sockaddr_in6 *client, CircularBuffer *window, FILE *export_file, int bytesRead){
-
-    // Variables for sending data
-    int sequence_num = window->current;
-    int index = sequence_num % window->size;
-
-    printf("Current index: %d\n", index);
-    // Build packet to be sent.
-    uint8_t out_packet[MAX_PDU]; // Packet to be built
-
-    // Build packet with data from buffer.
-    build_packet(out_packet, sequence_num, FLAG_DATA, window->entries[index].data, bytesRead);
-
-
-    printf("\n"); 
-    printf("Highest: %d, Current: %d, Lowest: %d\n", window->highest, window->current, window->lowest);
-
-    // Send filename packet ot the server
-    int addr_Len = sizeof(struct sockaddr_in6);
-    int out_packet_len = 7 + bytesRead;
-    printf("packet length = %d\n", out_packet_len);
-
-    // Send packet to rcopy
-    safeSendto(socketNum, out_packet, out_packet_len, 0, (struct sockaddr *)client, addr_Len);
-
-    // Increase current after sending
-    window->current++;
-}
-
-/*This function is for resending a packet
-  flag_option is for picking what flag to put in the header*/
-  void resend_packet(int socketNum, struct sockaddr_in6 *client, uint32_t seq_num, CircularBuffer *window, int flag_option) {
-    int index = seq_num % window->size;  // Get circular buffer index
-
-    printf("Resending packet #%d from buffer index %d\n", seq_num, index);
-
-    // Get the correct data size
-    int data_size = window->entries[index].data_len;  // Ensure we use the correct stored size
-
-    // Build packet to be sent
-    uint8_t out_packet[MAX_PDU];
-    int packet_size = build_packet(out_packet, seq_num, flag_option, window->entries[index].data, data_size);
+/*Runs one session to completion in this process.
+  Waits on the session socket with pollCall until the session deadline,
+  a pace timer in the same poll set wakes it for paced sends*/
+void run_session(Session *session, RecvBatch *acks){
+    int pace_timer = pace_timer_create();
+    addToPollSet(pace_timer);
 
-    printf("SIZE OF PACKET:%d\n",packet_size);
-
-    // Send packet using correct length
-    int addr_len = sizeof(struct sockaddr_in6);
-    safeSendto(socketNum, out_packet, packet_size, 0, (struct sockaddr *)client, addr_len);
-}
-
-/*This function processes the packets coming from the client
-  It returns the flag from the packet
-  Returns -1 on error*/
-int process_rr_srej_eof(int socketNum, struct sockaddr_in6 *client, CircularBuffer *window){
-    uint8_t in_packet[MAX_PDU];
-    int addr_len = sizeof(struct sockaddr_in6);
-
-    // Receive the packet
-    int recv_len = safeRecvfrom(socketNum, in_packet, MAX_PDU, 0, (struct sockaddr *)client, &addr_len);
-    if (recv_len < 0){
-        perror("Error receiving acknowledgment");
-        return -1;
-    }
-
-    // Verify checksum
-    if (in_cksum((unsigned short *)in_packet, recv_len) != 0){
-        printf("Checksum error in acknowledgment packet. Ignoring.\n");
-        resend_packet(socketNum, client, window->lowest, window, FLAG_RESENT_DATA); 
-        return -1;
-    }
-
-    // Get SREJ/RR from the incoming packet
-    uint32_t seq_num;
-    memcpy(&seq_num, in_packet + 7, 4);
-    seq_num = ntohl(seq_num);
-    printf("Client is requesting packet:%d ------\n", seq_num); 
-
-    // Extract flag
-    uint8_t flag = in_packet[6];
-    //Check the flag and call send either RR or SREJ
-    if (flag == FLAG_RR){
-        printf("Received RR for packet #%d. Moving window forward.\n", seq_num);
-        window->lowest = seq_num;
-        window->highest = window->lowest + window->size;
-
-        // if (seq_num >= window->lowest) {  // Ensure we're moving forward, not backward
-        //     window->lowest = seq_num;
-        //     window->highest = window->lowest + window->size;
-    
-        //     if (window->current > window->highest) {
-        //         printf("Warning: Current sequence (%d) ahead of highest (%d). Adjusting.\n", window->current, window->highest);
-        //         window->current = window->highest;  // Prevent current from exceeding highest
-        //     }
-        // } else {
-        //     printf("Warning: Received RR for an earlier packet (%d), ignoring.\n", seq_num);
-        // }
-    }else if (flag == FLAG_SREJ){
-        printf("\n"); 
-        printf("Received SREJ for packet #%d. Resending...\n", seq_num);
-        resend_packet(socketNum, client, seq_num, window,FLAG_RESENT_DATA);
-    }else if(flag == FLAG_EOF){
-        printf("EOF FLAG DETECTED\n"); 
-    }else{
-        printf("Unexpected acknowledgment flag received. Ignoring.\n");
-    }
-
-    return flag; 
-}
-
-void send_eof(int socketNum, struct sockaddr_in6 *client, CircularBuffer *window){
-    uint8_t eof_packet[7]; // EOF packet size
-    int packet_len = 0;
-
-    // Build the packet with eof flag
-    packet_len = build_packet(eof_packet, window->current, FLAG_EOF, NULL, 0);
-
-    // Send the EOF packet
-    int addr_len = sizeof(struct sockaddr_in6);
-    safeSendto(socketNum, eof_packet, packet_len, 0, (struct sockaddr *)client, addr_len);
-}
-
-ServerState handle_send_data(int socketNum, struct sockaddr_in6 *client, CircularBuffer *window, FILE *export_file){
-    // Send data packets while window is open
-    while (window->current < window->highest){
-        int readBytes = read_file_to_buffer(window, export_file);
-        if (readBytes == -1){
-            return WAIT_EOF_ACK; // EOF detected, transition to DONE
+    while (session->state != DONE){
+        if (session->state == SEND_DATA){
+            handle_send_data(session, acks);
         }
-
-        send_data(socketNum, client, window, export_file, readBytes);
-    
-        // Process acknowledgments (RR/SREJ)
-        while ((pollCall(0)) == socketNum){
-            process_rr_srej_eof(socketNum, client, window);
+        if (session->state == DONE){
+            break;
         }
-    }
 
-        // If window is full, wait for acknowledgments
-    int attempts = 0;
-    while (window->current == window->highest){
-        int socketReady = pollCall(1000);
-        if(socketReady == -1){ // Poll with 1s timeout
-            if (++attempts >= 10){
-                printf("Client timed out. Ending transfer.\n"); //Probably have to change to something else. 
-                return DONE; 
-            }
-            printf("Resending from timeout:%d\n", window->current);
-            resend_packet(socketNum, client, window->lowest, window, FLAG_RESENT_TIMEOUT);
-        }else if(socketReady == socketNum) {
-            process_rr_srej_eof(socketNum, client, window);
+        pace_timer_arm(pace_timer, session->send_at_us);
+        long wait = session->deadline - session_now_ms();
+        int socketReady = pollCall(wait > 0 ? (int)wait : 0);
+        if (socketReady == session->socketNum){
+            session_readable(session, acks);
+        }else if (socketReady == pace_timer){
+            pace_timer_clear(pace_timer);
+            session_timer(session, acks);
+        }else if (socketReady == -1){
+            session_timer(session, acks);
         }
     }
-    return SEND_DATA; // Continue sending data
-}
-
-ServerState handle_wait_EOF_ack(int socketNum, struct sockaddr_in6 *client, CircularBuffer *window) {
-    int attempt = 0;
-    int pollResult;
 
-    while (attempt < 10) {
-        send_eof(socketNum, client, window);
-        printf("Sent EOF (Attempt %d/10)\n", attempt + 1);
-
-        pollResult = pollCall(1000);
-        
-        if(pollResult >= 0) {
-            attempt = 0;//Reset attempts
-            if(FLAG_EOF == process_rr_srej_eof(socketNum,client, window)){
-            return DONE;
-            break;
-           }
-        } else if(pollResult == -1) {
-            printf("Timeout waiting for EOF_ACK\n");
-            attempt++;
-        }
-    }
-    printf("EOF_ACK not received after 10 attempts. Terminating.\n");
-    return DONE;
+    removeFromPollSet(pace_timer);
+    close(pace_timer);
 }
 
 void server_FSM(int socketNum){
+    SendBatch *listen_batch = send_batch_create(ERROR_RATE > 0);
+
     while (1) { //Terminates when we ctrl c 
 
         //Initiate trouble maker 
@@ -362,10 +149,9 @@ void server_FSM(int socketNum){
         //Variables for communication
         FILE *export_file;
         struct sockaddr_in6 client; 
-        int window_size; 
-        int buffer_size;
+        TransferRequest request;
         
-       export_file = processFilenameAck(socketNum, &client, &window_size, &buffer_size);
+       export_file = processFilenameAck(listen_batch, socketNum, &client, &request);
        if(export_file == NULL){
             continue;
        }else{
@@ -379,25 +165,15 @@ void server_FSM(int socketNum){
                 int child_socket = udpServerSetup(0);
                 addToPollSet(child_socket); 
 
-                //Create buffer
-                CircularBuffer *window = (CircularBuffer *)malloc(sizeof(CircularBuffer));
-                buffer_init(window,window_size,buffer_size,buffer_size);                               
-                
-                ServerState state = SEND_DATA;
-                while (state != DONE) {
-                    switch (state) {
-                        case SEND_DATA:
-                            state = handle_send_data(child_socket, &client, window, export_file);
-                            break;
-                        case WAIT_EOF_ACK:
-                            state = handle_wait_EOF_ack(child_socket, &client, window);
-                            break;
-                        default:
-                            state = DONE;
-                    }
-                }
-                buffer_free(window);
-                fclose(export_file);
+                SendBatch *batch = send_batch_create(ERROR_RATE > 0);
+                RecvBatch *acks = recv_batch_create();
+                Session *session = session_create(child_socket, &client, export_file, &request, batch, &SERVER_OPTIONS);
+
+                run_session(session, acks);
+
+                session_free(session);
+                recv_batch_free(acks);
+                send_batch_free(batch);
                 close(child_socket);
                 exit(0);
             }else if(pid > 0){
@@ -413,10 +189,86 @@ int checkArgs(int argc, char *argv[])
 {
     // Checks args and returns port number
     int portNumber = 0;
+    int option = 0;
+    char *program = argv[0];
+    long cache_mb = CHUNK_CACHE_DEFAULT_MB;
+
+    SERVER_OPTIONS.congestion = &congestion_newreno;
+    SERVER_OPTIONS.prefetch_depth = SESSION_PREFETCH_DEPTH;
+    while ((option = getopt(argc, argv, "m:t:uzHM:cC:pP:R:K:v")) != -1)
+    {
+        if (option == 'm' && strcmp(optarg, "fork") == 0)
+        {
+            SERVER_MODE = MODE_FORK;
+        }
+        else if (option == 'm' && strcmp(optarg, "event") == 0)
+        {
+            SERVER_MODE = MODE_EVENT;
+        }
+        else if (option == 'm' && strcmp(optarg, "threads") == 0)
+        {
+            SERVER_MODE = MODE_THREADS;
+        }
+        else if (option == 't' && atoi(optarg) > 0)
+        {
+            WORKER_COUNT = atoi(optarg);
+        }
+        else if (option == 'u')
+        {
+            SERVER_OPTIONS.use_uring = 1;
+        }
+        else if (option == 'z')
+        {
+            SERVER_OPTIONS.use_mmap = 1;
+        }
+        else if (option == 'H')
+        {
+            buffer_set_huge_pages(true);
+        }
+        else if (option == 'M' && atol(optarg) >= 0)
+        {
+            buffer_set_memory_cap((size_t)atol(optarg) * 1024 * 1024);
+        }
+        else if (option == 'c')
+        {
+            SERVER_OPTIONS.use_cksum_index = 1;
+        }
+        else if (option == 'C' && congestion_find(optarg) != NULL)
+        {
+            SERVER_OPTIONS.congestion = congestion_find(optarg);
+        }
+        else if (option == 'p')
+        {
+            SERVER_OPTIONS.pace_window = 1;
+        }
+        else if (option == 'P' && atof(optarg) > 0)
+        {
+            SERVER_OPTIONS.pace_mbps = atof(optarg);
+        }
+        else if (option == 'R' && atoi(optarg) >= 0)
+        {
+            SERVER_OPTIONS.prefetch_depth = atoi(optarg);
+        }
+        else if (option == 'K' && atol(optarg) >= 0)
+        {
+            cache_mb = atol(optarg);
+        }
+        else if (option == 'v')
+        {
+            SERVER_OPTIONS.verbose = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-m fork|event|threads] [-t workers] [-u] [-z] [-H] [-M cap-MB] [-c] [-C reno|bbr|ledbat|none] [-p] [-P Mbps] [-R prefetch-windows] [-K cache-MB] [-v] [error_rate] [optional port number]\n", program);
+            exit(1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc < 2 || argc > 3)
     {
-        fprintf(stderr, "Usage: %s [error_rate] [optional port number]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-m fork|event|threads] [-t workers] [-u] [-z] [-H] [-M cap-MB] [-c] [-C reno|bbr|ledbat|none] [-p] [-P Mbps] [-R prefetch-windows] [-K cache-MB] [-v] [error_rate] [optional port number]\n", program);
         exit(1);
     }
 
@@ -429,6 +281,28 @@ int checkArgs(int argc, char *argv[])
         exit(1);
     }
     printf("Server Error_rate: %f\n", ERROR_RATE);
+    SERVER_OPTIONS.emulate_errors = ERROR_RATE > 0;
+    // A forked child only holds up its own client while it builds a
+    // sidecar, the event loops would hold up every session they run
+    SERVER_OPTIONS.index_in_background = SERVER_MODE != MODE_FORK;
+
+#ifndef USE_IO_URING
+    if (SERVER_OPTIONS.use_uring)
+    {
+        printf("Built without USE_IO_URING, ignoring -u\n");
+    }
+#endif
+    if (SERVER_OPTIONS.use_uring && SERVER_MODE == MODE_FORK)
+    {
+        printf("io_uring is only used by the event and threads modes\n");
+    }
+
+    // Made before any fork or worker thread so they all share it.
+    // Mapped sessions already share the page cache and skip it
+    if (cache_mb > 0 && !SERVER_OPTIONS.use_mmap)
+    {
+        SERVER_OPTIONS.chunk_cache = chunk_cache_create((size_t)cache_mb * 1024 * 1024);
+    }
 
     if (argc == 3)
     {
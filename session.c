@@ -0,0 +1,1117 @@
+/* One file transfer on the server side. The state machine is driven
+   from outside (by pollCall in a forked child or by the epoll loop) so
+   none of these functions block waiting for the client. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+#include "safeUtil.h"
+#include "communication.h"
+#include "checksum.h"
+
+// Per packet tracing, printed only when the server was started with -v
+#define SESSION_TRACE(session, ...) do { if ((session)->verbose) printf(__VA_ARGS__); } while (0)
+
+static void drain_acks(Session *session, RecvBatch *acks);
+static int map_file(Session *session);
+#ifdef USE_IO_URING
+static int submit_reads(Session *session);
+static void send_read_chunk(Session *session, int sequence_num, int len);
+#endif
+
+// Monotonic clock in milliseconds for session timers
+long session_now_ms(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/*Sets the retransmit timeout one RTO from now. While packets are
+  outstanding and the RTT is known, a tail loss probe is armed about two
+  smoothed RTTs out as well, so losing the last packets of a flight
+  costs a round trip or two instead of a full RTO. No probe follows a
+  timeout until a new sample ends the backoff*/
+static void arm_timer(Session *session){
+    CircularBuffer *window = session->window;
+    long now = session_now_ms();
+
+    session->timeout_at = now + rtt_timeout_ms(&session->rtt);
+    session->probe_at = 0;
+    if (session->rtt.has_sample && session->rtt.backoff == 0 &&
+        (window->lowest < window->current || session->state == WAIT_EOF_ACK)){
+        long probe_ms = 2 * session->rtt.srtt_us / 1000;
+        if (probe_ms < SESSION_PROBE_MIN_MS){
+            probe_ms = SESSION_PROBE_MIN_MS;
+        }
+        if (now + probe_ms < session->timeout_at){
+            session->probe_at = now + probe_ms;
+        }
+    }
+    session->deadline = session->probe_at > 0 ? session->probe_at : session->timeout_at;
+}
+
+/*One past the last sequence number the session may send now: the
+  receiver window cut down to the congestion window and to the window
+  the client last advertised*/
+static int send_limit(Session *session){
+    CircularBuffer *window = session->window;
+    int allowed = congestion_window(&session->congestion);
+    if (session->peer_window < allowed){
+        allowed = session->peer_window;
+    }
+    return window->lowest + allowed;
+}
+
+/*Picks the pacing rate for the next sends. A rate from the congestion
+  controller comes first. A window based controller is paced at its
+  window per smoothed RTT when window pacing is on. The configured rate
+  caps either*/
+static void update_pacing(Session *session){
+    double rate = session->congestion.pacing_rate;
+
+    if (rate <= 0 && session->pace_window && session->rtt.has_sample && session->rtt.srtt_us > 0){
+        rate = PACER_WINDOW_GAIN * congestion_window(&session->congestion) * 1000000.0 / session->rtt.srtt_us;
+    }
+    if (session->pace_cap > 0 && (rate <= 0 || rate > session->pace_cap)){
+        rate = session->pace_cap;
+    }
+    pacer_set_rate(&session->pacer, rate);
+}
+
+/*Keeps the next prefetch_depth windows of the file on their way into
+  the page cache, so the fread, io_uring read or mapping touch for a
+  chunk finds it there instead of waiting on the disk. The kernel reads
+  the hinted range in the background. A new hint goes out once less
+  than depth - 1 windows are left staged, so it is one call per window
+  and not one per packet.
+  A hint is enough here: on a cold file read at 10MB/s a whole transfer
+  takes as long as reading the file, and a helper thread doing the reads
+  itself was no faster*/
+static void prefetch(Session *session){
+    CircularBuffer *window = session->window;
+    long chunk = window->buffer_size;
+
+    if (session->prefetch_depth <= 0 ||
+        session->prefetched > window->current + (long)(session->prefetch_depth - 1) * window->size){
+        return;
+    }
+    long start = session->prefetched > window->current ? session->prefetched : window->current;
+    long end = window->current + (long)session->prefetch_depth * window->size;
+    if ((end - start) * chunk > SESSION_PREFETCH_MAX_BYTES){
+        end = start + SESSION_PREFETCH_MAX_BYTES / chunk;
+    }
+    posix_fadvise(fileno(session->export_file), (off_t)start * chunk, (off_t)(end - start) * chunk, POSIX_FADV_WILLNEED);
+    session->prefetched = end;
+}
+
+/*Called when pacing stopped the send loop with the window still open,
+  the pace timer brings it back when the next packet is due*/
+static void pace_wait(Session *session){
+    session->send_at_us = session->pacer.next_send_us;
+}
+
+/*Fills in what the congestion controller is told about an event*/
+static void make_signal(Session *session, CongestionSignal *signal, int seq, int acked, long rtt_us){
+    signal->seq = seq;
+    signal->acked = acked;
+    signal->in_flight = session->window->current - session->window->lowest;
+    signal->next_seq = session->window->current;
+    signal->now_us = rtt_now_us();
+    signal->rtt_us = rtt_us;
+}
+
+/*Times sequence_num for an RTT sample unless a packet is already being
+  timed. One packet at a time is enough, the window keeps them coming*/
+static void time_packet(Session *session, int sequence_num){
+    if (session->timed_seq < 0){
+        session->timed_seq = sequence_num;
+        session->timed_at_us = rtt_now_us();
+    }
+}
+
+// This function sends a filename ack, echoing the FEC ratio when one was taken
+void send_filename_ack(SendBatch *batch, int socketNum, struct sockaddr_in6 *client, const TransferRequest *request){
+    uint8_t fec_ratio[FEC_REQUEST_LEN] = {request->fec_data, request->fec_parity};
+
+    // Build packet
+    send_batch_add(batch, 0, FLAG_FILENAME_ACK, fec_ratio, request->fec_data > 0 ? FEC_REQUEST_LEN : 0);
+
+    // Send to client socket
+    send_batch_flush(batch, socketNum, client);
+}
+
+// This function sends a filename_error
+void send_filename_error(SendBatch *batch, int socketNum, struct sockaddr_in6 *client){
+    // Build packet
+    send_batch_add(batch, 0, FLAG_FILENAME_ERROR, NULL, 0);
+
+    // Send to client socket
+    send_batch_flush(batch, socketNum, client);
+}
+
+/*This function processes one filename packet from rcopy.
+  It fills request with the filename, window-size, and buffer-size and answers the
+  client with an ack or an error, sent through batch.
+  Returns the opened file or NULL if the packet was bad or the file
+  could not be opened*/
+FILE *process_filename_packet(SendBatch *batch, int socketNum, struct sockaddr_in6 *client, uint8_t *buffer, int dataLen, TransferRequest *request){
+    // Verify checksum
+    if (in_cksum((unsigned short *)buffer, dataLen) != 0) {
+        fprintf(stderr, "Checksum verification failed\n");
+        return NULL;
+    }
+
+    printf("Checksum Passed!\n");
+
+    // RRs from a client that already moved on can land here too
+    if (dataLen < 15 || buffer[6] != FLAG_FILENAME) {
+        fprintf(stderr, "Not a filename packet, ignoring (flag %d)\n", buffer[6]);
+        return NULL;
+    }
+
+    // Extract window size and buffer size
+    request->window_size = ntohl(*(uint32_t *)(buffer + 7));
+    request->buffer_size = ntohl(*(uint32_t *)(buffer + 11));
+
+    if (request->window_size <= 0 || request->window_size >= (1 << 30) || request->buffer_size <= 0 || request->buffer_size > MAX_PAYLOAD_SIZE) {
+        fprintf(stderr, "Bad window size %d or buffer size %d\n", request->window_size, request->buffer_size);
+        send_filename_error(batch, socketNum, client);
+        return NULL;
+    }
+
+    // The window's entry array is sized from it, keep it within what the
+    // memory cap could ever fill
+    int window_limit = buffer_window_limit();
+    if (request->window_size > window_limit) {
+        printf("Window size %d clamped to %d\n", request->window_size, window_limit);
+        request->window_size = window_limit;
+    }
+
+    // Extract filename safely, it runs to the end of the packet or a NUL
+    char *filename = request->filename;
+    int filename_len = dataLen - 15;
+    uint8_t *terminator = memchr(buffer + 15, '\0', filename_len);
+    if (terminator != NULL) {
+        filename_len = terminator - (buffer + 15);
+    }
+    if (filename_len > MAX_FILENAME_SIZE) {
+        filename_len = MAX_FILENAME_SIZE;
+    }
+    memcpy(filename, buffer + 15, filename_len);
+    filename[filename_len] = '\0';  // Ensure null termination
+
+    // The transfer class follows the NUL, older clients send neither
+    request->transfer_class = TRANSFER_NORMAL;
+    if (terminator != NULL && terminator + 1 < buffer + dataLen && terminator[1] == TRANSFER_BACKGROUND) {
+        request->transfer_class = TRANSFER_BACKGROUND;
+    }
+
+    // Then the FEC block shape, a ratio this end can't do means no FEC
+    request->fec_data = 0;
+    request->fec_parity = 0;
+    if (terminator != NULL && terminator + 1 + FEC_REQUEST_LEN < buffer + dataLen &&
+        fec_valid_ratio(terminator[2], terminator[3])) {
+        request->fec_data = terminator[2];
+        request->fec_parity = terminator[3];
+    }
+
+    // Attempt to open the requested file
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Failed to open file");
+        send_filename_error(batch, socketNum, client);
+        return NULL;
+    }
+
+    // Send acknowledgment after successfully opening the file
+    send_filename_ack(batch, socketNum, client, request);
+    return file;
+}
+
+/*Sets up a session in the SEND_DATA state. socketNum is the socket
+  the data will be sent from. With options->use_mmap the window points
+  into a mapping of the file instead of holding copies, falling back to
+  fread if the file can't be mapped. With options->use_cksum_index the
+  payload sums come from the file's sidecar instead of being computed.
+  With options->chunk_cache an unmapped session reads its chunks through
+  the cache every session shares. A background transfer runs LEDBAT whatever options->congestion is*/
+Session *session_create(int socketNum, struct sockaddr_in6 *client, FILE *export_file, const TransferRequest *request, SendBatch *batch, const ServerOptions *options){
+    int window_size = request->window_size;
+    int buffer_size = request->buffer_size;
+
+    Session *session = (Session *)sCalloc(1, sizeof(Session));
+
+    session->socketNum = socketNum;
+    memcpy(&session->client, client, sizeof(struct sockaddr_in6));
+    session->export_file = export_file;
+    session->batch = batch;
+    session->state = SEND_DATA;
+    session->attempts = 0;
+    rtt_init(&session->rtt);
+    session->timed_seq = -1;
+    session->timed_at_us = 0;
+    session->dup_rrs = 0;
+    const CongestionOps *congestion = options->congestion != NULL ? options->congestion : &congestion_newreno;
+    if (request->transfer_class == TRANSFER_BACKGROUND){
+        printf("Background transfer, yielding to other traffic\n");
+        congestion = &congestion_ledbat;
+    }
+    congestion_init(&session->congestion, congestion, window_size);
+    session->peer_window = window_size;
+    session->timer_slot = -1;
+    pacer_init(&session->pacer);
+    session->send_at_us = 0;
+    session->pace_window = options->pace_window;
+    // Mbit/s to packets per second of this buffer size
+    session->pace_cap = options->pace_mbps * 125000.0 / (buffer_size + HEADER_SIZE);
+    session->ring = NULL;
+    session->eof_seq = -1;
+    session->reads_inflight = 0;
+    session->io_inflight = 0;
+    session->map = NULL;
+    session->map_len = 0;
+    session->cksum_index = NULL;
+    session->prefetch_depth = options->prefetch_depth;
+    session->verbose = options->verbose;
+    session->prefetched = 0;
+    if (session->prefetch_depth > 0){
+        // Also lets the kernel's own read ahead run twice as far
+        posix_fadvise(fileno(export_file), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (options->use_cksum_index){
+        session->cksum_index = cksum_index_open(request->filename, export_file, buffer_size, options->index_in_background);
+    }
+    session->fec = NULL;
+    if (request->fec_data > 0){
+        printf("FEC: %d parity packets per %d data packets\n", request->fec_parity, request->fec_data);
+        session->fec = fec_encoder_create(request->fec_data, request->fec_parity, buffer_size);
+    }
+
+    //Create buffer
+    session->window = (CircularBuffer *)malloc(sizeof(CircularBuffer));
+    if (options->use_mmap && map_file(session)){
+        buffer_init_mapped(session->window, window_size, buffer_size, window_size);
+    }else{
+        buffer_init(session->window, window_size, buffer_size, window_size);
+    }
+    session->cache = NULL;
+    if (options->chunk_cache != NULL && !session->window->mapped &&
+        chunk_cache_file_id(fileno(export_file), &session->file_id)){
+        session->cache = options->chunk_cache;
+    }
+    arm_timer(session);
+
+    return session;
+}
+
+/*Maps the whole export file read only.
+  Returns 0 if it can't be mapped. An empty file counts as mapped, it
+  just has no chunks*/
+static int map_file(Session *session){
+    struct stat info;
+    int fd = fileno(session->export_file);
+
+    if (fstat(fd, &info) < 0){
+        perror("fstat");
+        return 0;
+    }
+    session->map_len = info.st_size;
+    if (session->map_len == 0){
+        return 1;
+    }
+
+    void *map = mmap(NULL, session->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED){
+        perror("mmap export file");
+        session->map_len = 0;
+        return 0;
+    }
+    madvise(map, session->map_len, MADV_SEQUENTIAL);
+    session->map = map;
+    return 1;
+}
+
+/*Frees the session and closes its file. The socket is left to the caller*/
+void session_free(Session *session){
+    if (session->map != NULL){
+        munmap(session->map, session->map_len);
+    }
+    if (session->cksum_index != NULL){
+        cksum_index_free(session->cksum_index);
+    }
+    if (session->fec != NULL){
+        fec_encoder_free(session->fec);
+    }
+    congestion_free(&session->congestion);
+    buffer_free(session->window);
+    fclose(session->export_file);
+    free(session);
+}
+
+/*Fills chunk with the chunk of the file at sequence_num from the
+  shared chunk cache, reading it at its offset and caching it on a miss.
+  Returns the bytes read, 0 past the end of the file*/
+static ssize_t read_cached(Session *session, int sequence_num, uint8_t *chunk){
+    int chunk_size = session->window->buffer_size;
+    long offset = (long)sequence_num * chunk_size;
+
+    ssize_t bytesRead = chunk_cache_get(session->cache, &session->file_id, offset, chunk_size, chunk);
+    if (bytesRead >= 0){
+        return bytesRead;
+    }
+    bytesRead = pread(fileno(session->export_file), chunk, chunk_size, offset);
+    if (bytesRead < 0){
+        perror("pread");
+        return 0;
+    }
+    chunk_cache_put(session->cache, &session->file_id, offset, chunk_size, chunk, bytesRead);
+    return bytesRead;
+}
+
+/*Reads the next chunk of the file straight into its window slot.
+  Returns -1 when EOF, SESSION_NO_MEMORY when the window memory cap
+  leaves no chunk for the slot*/
+int read_file_to_buffer(Session *session){
+    CircularBuffer *window = session->window;
+    size_t bytesRead; // Bytes read from fread
+
+    int sequence_num = window->current;
+    int index = buffer_index(window, sequence_num);
+
+    uint8_t *chunk = buffer_reserve(window, sequence_num);
+    if (chunk == NULL){
+        printf("Window memory cap reached, holding packet #%d\n", sequence_num);
+        return SESSION_NO_MEMORY;
+    }
+
+    if (session->cache != NULL){
+        bytesRead = read_cached(session, sequence_num, chunk);
+    }else{
+        bytesRead = fread(chunk, 1, window->buffer_size, session->export_file);
+    }
+
+    if (bytesRead == 0){
+        // switch state to eof
+        printf("END OF FILE!!!!!!!!!!!\n");
+        buffer_release(window, sequence_num);
+        return -1; // End of file
+    }
+
+    SESSION_TRACE(session, "----------------Seq Num: %d---------------------\n", sequence_num);
+    SESSION_TRACE(session, "Highest: %d, Current: %d, Lowest: %d\n\n", window->highest, window->current, window->lowest);
+
+    // The data is already in the window data structure :)
+    window->entries[index].valid_flag = true;
+    window->entries[index].data_len = bytesRead; //Add length of data to the index
+
+    return bytesRead;
+}
+
+/*Mapped version of read_file_to_buffer, the window slot is pointed at
+  the chunk in the mapping instead of getting a copy.
+  Returns -1 when EOF*/
+int map_file_to_buffer(Session *session){
+    CircularBuffer *window = session->window;
+    int sequence_num = window->current;
+    size_t offset = (size_t)sequence_num * window->buffer_size;
+
+    if (offset >= session->map_len){
+        printf("END OF FILE!!!!!!!!!!!\n");
+        return -1; // End of file
+    }
+
+    int bytesRead = window->buffer_size;
+    if (session->map_len - offset < (size_t)bytesRead){
+        bytesRead = session->map_len - offset;
+    }
+
+    SESSION_TRACE(session, "----------------Seq Num: %d---------------------\n", sequence_num);
+    buffer_add_ref(window, sequence_num, session->map + offset, bytesRead);
+
+    return bytesRead;
+}
+
+/*Returns the stored payload sum of a chunk through sum, or 0 when the
+  session has no checksum index covering it*/
+static int indexed_sum(Session *session, int sequence_num, uint16_t *sum){
+    CksumIndex *index = session->cksum_index;
+
+    if (index == NULL || sequence_num >= index->chunk_count){
+        return 0;
+    }
+    *sum = index->sums[sequence_num];
+    return 1;
+}
+
+/*Adds a data packet's first send to the FEC block and queues the
+  block's parity packets behind it once the block is complete.
+  Retransmissions are never summed, the receiver has the block by then*/
+static void send_parity(Session *session, int sequence_num, const uint8_t *payload, int len){
+    FecEncoder *fec = session->fec;
+
+    if (fec == NULL || !fec_encode(fec, sequence_num, payload, len)){
+        return;
+    }
+    for (int j = 0; j < fec->parity; j++){
+        if (session->batch->count == SEND_BATCH_MAX){
+            send_batch_flush(session->batch, session->socketNum, &session->client);
+        }
+        send_batch_add(session->batch, fec_encoder_parity_seq(fec, j), FLAG_PARITY, fec_encoder_parity(fec, j), fec->buffer_size);
+    }
+}
+
+/*Queues the packet for the current window slot into the send batch.
+  The batch is handed to the kernel by send_batch_flush*/
+void send_data(Session *session, int bytesRead){
+    SendBatch *batch = session->batch;
+    CircularBuffer *window = session->window;
+    uint16_t payload_sum;
+
+    // Variables for sending data
+    int sequence_num = window->current;
+    int index = buffer_index(window, sequence_num);
+
+    SESSION_TRACE(session, "Current index: %d\n", index);
+
+    // Build packet with data from buffer, mapped chunks are sent in place.
+    // An indexed chunk is sent in place too, its sum is already known
+    if (indexed_sum(session, sequence_num, &payload_sum)){
+        send_batch_add_summed(batch, sequence_num, FLAG_DATA, window->entries[index].data, bytesRead, payload_sum);
+    }else if (window->mapped){
+        send_batch_add_ref(batch, sequence_num, FLAG_DATA, window->entries[index].data, bytesRead);
+    }else{
+        send_batch_add(batch, sequence_num, FLAG_DATA, window->entries[index].data, bytesRead);
+    }
+    // Kept so a retransmit only has to patch the flag
+    memcpy(window->entries[index].header, send_batch_last_header(batch), HEADER_SIZE);
+    time_packet(session, sequence_num);
+    send_parity(session, sequence_num, window->entries[index].data, bytesRead);
+
+    SESSION_TRACE(session, "\nHighest: %d, Current: %d, Lowest: %d\n", window->highest, window->current, window->lowest);
+    SESSION_TRACE(session, "packet length = %d\n", HEADER_SIZE + bytesRead);
+
+    // Increase current after sending
+    window->current++;
+}
+
+/*This function is for resending a packet
+  flag_option is for picking what flag to put in the header
+  The header kept from the first send gets the new flag and an
+  incrementally updated checksum, the payload is not summed again.
+  The packet is queued in the session's batch, the caller flushes.
+  Returns 1 when it was queued, 0 when its slot doesn't hold it*/
+int resend_packet(Session *session, uint32_t seq_num, int flag_option){
+    CircularBuffer *window = session->window;
+    int index = buffer_index(window, seq_num);  // Get circular buffer index
+
+    SESSION_TRACE(session, "Resending packet #%d from buffer index %d\n", seq_num, index);
+
+    // An io_uring read may still be filling the slot
+    if (!window->entries[index].valid_flag || window->entries[index].sequence_num != (int)seq_num){
+        printf("Packet #%d is not in the window, nothing to resend\n", seq_num);
+        return 0;
+    }
+
+    // Get the correct data size
+    int data_size = window->entries[index].data_len;  // Ensure we use the correct stored size
+
+    // Karn: the RR for a retransmitted packet could answer either copy
+    if (session->timed_seq == (int)seq_num){
+        session->timed_seq = -1;
+    }
+
+    if (session->batch->count == SEND_BATCH_MAX){
+        send_batch_flush(session->batch, session->socketNum, &session->client);
+    }
+    rewrite_flag(window->entries[index].header, flag_option);
+    send_batch_add_built(session->batch, window->entries[index].header, window->entries[index].data, data_size);
+    return 1;
+}
+
+/*Moves the window up to an RR (or a SACK's cumulative ack), times the
+  round trip and tells the congestion controller*/
+static void process_rr(Session *session, uint32_t seq_num){
+    CircularBuffer *window = session->window;
+    CongestionSignal signal;
+
+    SESSION_TRACE(session, "Received RR for packet #%d. Moving window forward.\n", seq_num);
+    if ((int)seq_num < window->lowest) {  // Ensure we're moving forward, not backward
+        printf("Warning: Received RR for an earlier packet (%d), ignoring.\n", seq_num);
+        return;
+    }
+
+    long rtt_us = -1;
+    if (session->timed_seq >= 0 && (int)seq_num > session->timed_seq){
+        rtt_us = rtt_now_us() - session->timed_at_us;
+        rtt_sample(&session->rtt, rtt_us);
+        session->timed_seq = -1;
+    }
+    int acked = ((int)seq_num < window->current ? (int)seq_num : window->current) - window->lowest;
+    make_signal(session, &signal, seq_num, acked, rtt_us);
+    congestion_on_ack(&session->congestion, &signal);
+    // Everything below the RR is delivered, its chunks can go back to the
+    // pool. A resend queued in the batch may still point into one, and in
+    // threads mode another worker can take a freed chunk at once
+    if (session->batch->count > 0 && (int)seq_num > window->lowest){
+        send_batch_flush(session->batch, session->socketNum, &session->client);
+    }
+    for (int seq = window->lowest; seq < (int)seq_num && seq < window->current; seq++){
+        buffer_release(window, seq);
+    }
+    window->lowest = seq_num;
+    window->highest = window->lowest + window->size;
+}
+
+/*Counts RRs, and SACKs, that repeat the lowest unacknowledged packet
+  while data is outstanding. rcopy only repeats an RR when its SACK or
+  SREJ may have been lost: it timed out waiting, or a duplicate arrived.
+  Once it buffers out of order packets it only sends SACKs. After
+  SESSION_DUP_RRS of them the lowest packet is resent at once instead of
+  after the retransmit timeout*/
+static void count_duplicate_rr(Session *session, uint32_t seq_num){
+    CircularBuffer *window = session->window;
+    CongestionSignal signal;
+
+    if ((int)seq_num != window->lowest || window->lowest >= window->current){
+        session->dup_rrs = 0;
+        return;
+    }
+    if (++session->dup_rrs < SESSION_DUP_RRS){
+        return;
+    }
+    session->dup_rrs = 0;
+
+    BufferEntry *entry = &window->entries[buffer_index(window, seq_num)];
+    long now_us = rtt_now_us();
+    if (entry->sequence_num == (int)seq_num && entry->resent_us != 0 && session->rtt.has_sample &&
+        now_us - entry->resent_us < session->rtt.srtt_us){
+        return; // Resent within the last round trip, the copy is still on its way
+    }
+    printf("%d duplicate RRs for packet #%d, fast retransmit\n", SESSION_DUP_RRS, seq_num);
+    make_signal(session, &signal, seq_num, 0, -1);
+    congestion_on_loss(&session->congestion, &signal);
+    if (resend_packet(session, seq_num, FLAG_RESENT_DATA)){
+        entry->resent_us = now_us;
+    }
+}
+
+/*Resends one hole a SACK shows unless it was resent less than gap_us
+  ago. Returns 1 when it was resent, and counts it in fresh too when it
+  had never been resent before*/
+static int resend_hole(Session *session, int seq, long now_us, long gap_us, int *fresh){
+    CircularBuffer *window = session->window;
+    BufferEntry *entry = &window->entries[buffer_index(window, seq)];
+
+    if (seq >= window->current){
+        return 0;
+    }
+    if (entry->sequence_num == seq && entry->resent_us != 0 && now_us - entry->resent_us < gap_us){
+        return 0;
+    }
+    int first = entry->resent_us == 0;
+    if (!resend_packet(session, seq, FLAG_RESENT_DATA)){
+        return 0;
+    }
+    entry->resent_us = now_us;
+    *fresh += first;
+    return 1;
+}
+
+/*Resends every hole a SACK shows in one pass: the cumulative ack
+  itself, even with no bit set past it, and each sequence number the
+  bitmap leaves out below the highest one it marks received. Bit i of the bitmap (most significant
+  bit of each byte first) stands for cumulative + 1 + i.
+  A hole resent less than a smoothed RTT ago is left alone, that copy
+  can't have been answered yet. Only a hole reported for the first time
+  is a new loss for the congestion controller, a SACK repeating holes
+  that are already being mended would cut the window once per RTT for
+  as long as they stay open*/
+static void process_sack(Session *session, uint32_t cumulative, const uint8_t *bitmap, int bitmap_len){
+    CircularBuffer *window = session->window;
+    CongestionSignal signal;
+    int bits = bitmap_len * 8;
+    long now_us = rtt_now_us();
+    long resend_gap_us = session->rtt.has_sample ? session->rtt.srtt_us : 0;
+
+    if (bits > SACK_MAX_BITS){
+        bits = SACK_MAX_BITS;
+    }
+    int last = -1;
+    for (int bit = bits - 1; bit >= 0; bit--){
+        if (bitmap[bit / 8] & (0x80 >> (bit % 8))){
+            last = bit;
+            break;
+        }
+    }
+
+    int fresh = 0;
+    int resent = resend_hole(session, cumulative, now_us, resend_gap_us, &fresh);
+    for (int bit = 0; bit < last; bit++){
+        if (bitmap[bit / 8] & (0x80 >> (bit % 8))){
+            continue;
+        }
+        int seq = cumulative + 1 + bit;
+        if (seq >= window->current){
+            break;
+        }
+        resent += resend_hole(session, seq, now_us, resend_gap_us, &fresh);
+    }
+    if (fresh > 0){
+        make_signal(session, &signal, cumulative, 0, -1);
+        congestion_on_loss(&session->congestion, &signal);
+    }
+    printf("Received SACK from packet #%d, resent %d holes\n", cumulative, resent);
+}
+
+/*This function processes a packet coming from the client
+  It returns the flag from the packet
+  Returns -1 on error
+  Retransmissions are queued into the session's batch*/
+int process_rr_srej_eof(Session *session, uint8_t *in_packet, int recv_len){
+    CircularBuffer *window = session->window;
+    CongestionSignal signal;
+
+    // Verify checksum
+    if (recv_len < HEADER_SIZE || in_cksum((unsigned short *)in_packet, recv_len) != 0){
+        printf("Checksum error in acknowledgment packet. Ignoring.\n");
+        resend_packet(session, window->lowest, FLAG_RESENT_DATA);
+        return -1;
+    }
+    // The EOF ack is a bare header, everything else carries a sequence number
+    if (in_packet[6] == FLAG_EOF){
+        printf("EOF FLAG DETECTED\n");
+        return FLAG_EOF;
+    }
+    if (recv_len < HEADER_SIZE + 4){
+        printf("Short acknowledgment packet. Ignoring.\n");
+        return -1;
+    }
+
+    // Get SREJ/RR from the incoming packet
+    uint32_t seq_num;
+    memcpy(&seq_num, in_packet + 7, 4);
+    seq_num = ntohl(seq_num);
+    SESSION_TRACE(session, "Client is requesting packet:%d ------\n", seq_num);
+
+    // Extract flag
+    uint8_t flag = in_packet[6];
+    //Check the flag and call send either RR or SREJ
+    if (flag == FLAG_RR){
+        // Newer clients follow the sequence number with their free window
+        if (recv_len >= 15){
+            uint32_t peer_window;
+            memcpy(&peer_window, in_packet + 11, 4);
+            peer_window = ntohl(peer_window);
+            session->peer_window = peer_window < (uint32_t)window->size ? (int)peer_window : window->size;
+        }
+        count_duplicate_rr(session, seq_num);
+        process_rr(session, seq_num);
+    }else if (flag == FLAG_SACK){
+        count_duplicate_rr(session, seq_num);
+        process_rr(session, seq_num);
+        process_sack(session, seq_num, in_packet + 11, recv_len - 11);
+    }else if (flag == FLAG_SREJ){
+        SESSION_TRACE(session, "\nReceived SREJ for packet #%d. Resending...\n", seq_num);
+        make_signal(session, &signal, seq_num, 0, -1);
+        congestion_on_loss(&session->congestion, &signal);
+        resend_packet(session, seq_num, FLAG_RESENT_DATA);
+    }else{
+        printf("Unexpected acknowledgment flag received. Ignoring.\n");
+    }
+
+    return flag;
+}
+
+/*Queues the EOF packet, its sequence number is one past the last data packet*/
+void send_eof(Session *session){
+    send_batch_add(session->batch, session->window->current, FLAG_EOF, NULL, 0);
+}
+
+/*Fills every slot the congestion window leaves open and sends them
+  with one sendmmsg call.
+  RRs and SREJs that arrived meanwhile are drained afterwards and the
+  requested retransmissions go out as another batch. Moves the session
+  to WAIT_EOF_ACK and sends the first EOF once the file is read*/
+void handle_send_data(Session *session, RecvBatch *acks){
+    CircularBuffer *window = session->window;
+
+    update_pacing(session);
+    prefetch(session);
+
+#ifdef USE_IO_URING
+    // A mapped file has nothing to read, its sends go through the batch
+    if (session->ring != NULL && !window->mapped){
+        int submitted;
+        do {
+            submitted = submit_reads(session);
+            drain_acks(session, acks);
+        } while (submitted > 0 && session->state == SEND_DATA && session->eof_seq < 0 && window->current < send_limit(session));
+        return;
+    }
+#endif
+
+    // Send data packets while window is open
+    while (session->state == SEND_DATA && window->current < send_limit(session)){
+        int readBytes = 0;
+        int paced = 0;
+        while (window->current < send_limit(session) && session->batch->count < SEND_BATCH_MAX){
+            long now_us = rtt_now_us();
+            if (!pacer_ready(&session->pacer, now_us)){
+                paced = 1;
+                break;
+            }
+            if (window->mapped){
+                readBytes = map_file_to_buffer(session);
+            }else{
+                readBytes = read_file_to_buffer(session);
+            }
+            if (readBytes < 0){
+                break;
+            }
+            send_data(session, readBytes);
+            pacer_sent(&session->pacer, now_us);
+        }
+
+        if (readBytes == -1){
+            session->state = WAIT_EOF_ACK; // EOF detected
+            session->attempts = 0;
+            send_eof(session);
+            printf("Sent EOF (Attempt %d/%d)\n", session->attempts + 1, SESSION_MAX_ATTEMPTS);
+        }
+        send_batch_flush(session->batch, session->socketNum, &session->client);
+        arm_timer(session);
+
+        // Process acknowledgments (RR/SREJ)
+        drain_acks(session, acks);
+
+        // Wait for RRs to hand chunks back before reading on
+        if (readBytes == SESSION_NO_MEMORY){
+            break;
+        }
+        if (paced){
+            pace_wait(session);
+            break;
+        }
+    }
+}
+
+#ifdef USE_IO_URING
+/*io_uring version of filling the window: queues a read straight into
+  every open window slot. Each data packet is queued for sending as its
+  read completes (session_io_complete). The event loop hands reads and
+  sends to the kernel together in its next io_uring_enter.
+  Returns the number of reads queued*/
+static int submit_reads(Session *session){
+    CircularBuffer *window = session->window;
+    int fd = fileno(session->export_file);
+    int queued = 0;
+
+    while (session->eof_seq < 0 && window->current < send_limit(session)){
+        int sequence_num = window->current;
+        long now_us = rtt_now_us();
+        if (!pacer_ready(&session->pacer, now_us)){
+            pace_wait(session);
+            break;
+        }
+        // A read and the send behind it each post a completion. The
+        // completion queue is shared by every session on the ring, the
+        // ones already in flight hand room back as they are reaped
+        if (!uring_room(session->ring, 2)){
+            break;
+        }
+
+        uint8_t *chunk = buffer_reserve(window, sequence_num);
+        if (chunk == NULL){
+            break; // Window memory cap, RRs will free chunks
+        }
+
+        // Another session already read this chunk, send it without a read
+        if (session->cache != NULL){
+            long offset = (long)sequence_num * window->buffer_size;
+            int len = chunk_cache_get(session->cache, &session->file_id, offset, window->buffer_size, chunk);
+            if (len > 0){
+                if (session->batch->count == SEND_BATCH_MAX){
+                    send_batch_flush(session->batch, session->socketNum, &session->client);
+                }
+                window->current++;
+                send_read_chunk(session, sequence_num, len);
+                pacer_sent(&session->pacer, now_us);
+                continue;
+            }
+        }
+
+        UringRequest *request = uring_request_get(session->ring, URING_OP_READ, session, sequence_num);
+        if (!uring_prep_read(session->ring, request, fd, chunk, window->buffer_size, (off_t)sequence_num * window->buffer_size)){
+            uring_request_put(session->ring, request);
+            buffer_release(window, sequence_num);
+            break;
+        }
+        session->reads_inflight++;
+        session->io_inflight++;
+        queued++;
+        pacer_sent(&session->pacer, now_us);
+
+        window->current++;
+    }
+    send_batch_flush(session->batch, session->socketNum, &session->client);
+    arm_timer(session);
+    return queued;
+}
+
+/*Sends a chunk that just landed in its window slot as a data packet,
+  through the batch when emulating errors or when the submission queue
+  is full, and io_uring otherwise*/
+static void send_read_chunk(Session *session, int sequence_num, int len){
+    CircularBuffer *window = session->window;
+    int index = buffer_index(window, sequence_num);
+
+    window->entries[index].valid_flag = true;
+    window->entries[index].data_len = len;
+    SESSION_TRACE(session, "----------------Seq Num: %d---------------------\n", sequence_num);
+
+    int queued = 0;
+    if (!session->batch->emulate_errors){
+        UringRequest *send = uring_request_get(session->ring, URING_OP_SEND, session, sequence_num);
+        uint16_t payload_sum;
+        int packet_len;
+        if (indexed_sum(session, sequence_num, &payload_sum)){
+            packet_len = build_header_summed(send->packet, sequence_num, FLAG_DATA, len, payload_sum);
+            memcpy(send->packet + HEADER_SIZE, window->entries[index].data, len);
+        }else{
+            packet_len = build_packet(send->packet, sequence_num, FLAG_DATA, window->entries[index].data, len);
+        }
+        queued = uring_prep_send(session->ring, send, session->socketNum, &session->client, packet_len);
+        if (queued){
+            memcpy(window->entries[index].header, send->packet, HEADER_SIZE);
+            session->io_inflight++;
+        }else{
+            uring_request_put(session->ring, send);
+        }
+    }
+    if (!queued){
+        if (session->batch->count == SEND_BATCH_MAX){
+            send_batch_flush(session->batch, session->socketNum, &session->client);
+        }
+        send_batch_add(session->batch, sequence_num, FLAG_DATA, window->entries[index].data, len);
+        memcpy(window->entries[index].header, send_batch_last_header(session->batch), HEADER_SIZE);
+    }
+    time_packet(session, sequence_num);
+    send_parity(session, sequence_num, window->entries[index].data, len);
+}
+
+/*Feeds an io_uring completion back into the state machine.
+  A finished read is sent as a data packet, a read that hits the end of
+  the file moves the session to WAIT_EOF_ACK once the reads before it
+  are done*/
+void session_io_complete(Session *session, UringRequest *request, int result){
+    CircularBuffer *window = session->window;
+    int sequence_num = request->seq_num;
+    int index = buffer_index(window, sequence_num);
+
+    session->io_inflight--;
+    if (request->op == URING_OP_SEND){
+        if (result < 0){
+            fprintf(stderr, "io_uring send of packet #%d: %s\n", sequence_num, strerror(-result));
+        }
+        return;
+    }
+
+    session->reads_inflight--;
+    if (session->state != SEND_DATA){
+        return;
+    }
+
+    if (result < 0){
+        fprintf(stderr, "io_uring read of packet #%d: %s\n", sequence_num, strerror(-result));
+        session->state = DONE;
+        return;
+    }
+
+    if (result == 0){
+        if (session->eof_seq < 0 || sequence_num < session->eof_seq){
+            session->eof_seq = sequence_num;
+        }
+    }else{
+        if (session->cache != NULL){
+            chunk_cache_put(session->cache, &session->file_id, (long)sequence_num * window->buffer_size,
+                            window->buffer_size, window->entries[index].data, result);
+        }
+        send_read_chunk(session, sequence_num, result);
+    }
+
+    if (session->eof_seq >= 0 && session->reads_inflight == 0){
+        printf("END OF FILE!!!!!!!!!!!\n");
+        // Drop the slots reserved past the end
+        for (int unused = session->eof_seq; unused < window->current; unused++){
+            buffer_release(window, unused);
+        }
+        window->current = session->eof_seq;
+        session->state = WAIT_EOF_ACK;
+        session->attempts = 0;
+        send_eof(session);
+        printf("Sent EOF (Attempt %d/%d)\n", session->attempts + 1, SESSION_MAX_ATTEMPTS);
+    }
+    send_batch_flush(session->batch, session->socketNum, &session->client);
+    arm_timer(session);
+}
+#endif
+
+/*Handles a packet that arrived while waiting for the EOF ack.
+  Anything other than the EOF ack means the client still wants data.
+  Once every data packet is acked that can only be the EOF, so it is
+  sent again. Holes before it are mended by the SACK, duplicate RR and
+  tail loss probe resends, a copy of the EOF for each of those packets
+  would only crowd them*/
+void handle_wait_EOF_ack(Session *session, int flag){
+    if (flag == FLAG_EOF){
+        session->state = DONE;
+        return;
+    }
+    if (session->window->lowest < session->window->current){
+        return;
+    }
+    send_eof(session);
+    printf("Sent EOF (Attempt %d/%d)\n", session->attempts + 1, SESSION_MAX_ATTEMPTS);
+}
+
+/*Processes every packet already queued on the session socket without
+  waiting for more*/
+static void drain_acks(Session *session, RecvBatch *acks){
+    int packet_len = 0;
+    uint8_t *in_packet;
+
+    while (session->state != DONE && recv_batch_fill(acks, session->socketNum) > 0){
+        int lowest = session->window->lowest;
+        session->attempts = 0; // Client is still there
+        while ((in_packet = recv_batch_next(acks, &packet_len, NULL)) != NULL){
+            int flag = process_rr_srej_eof(session, in_packet, packet_len);
+            if (session->state == WAIT_EOF_ACK){
+                handle_wait_EOF_ack(session, flag);
+                if (session->state == DONE){
+                    break;
+                }
+            }
+        }
+        send_batch_flush(session->batch, session->socketNum, &session->client);
+        // Only new data acked restarts the retransmit timer, a client
+        // repeating its RR must not hold back the resend it is asking for
+        if (session->window->lowest != lowest){
+            arm_timer(session);
+        }
+    }
+}
+
+/*Called when the session socket is readable. Processes the client's
+  packets then sends whatever the window now allows*/
+void session_readable(Session *session, RecvBatch *acks){
+    drain_acks(session, acks);
+    if (session->state == SEND_DATA){
+        handle_send_data(session, acks);
+    }
+}
+
+/*Called when the client has been quiet until the session deadline.
+  Resends the lowest unacknowledged packet, or the EOF*/
+void session_timeout(Session *session){
+    // Nothing in flight means the window memory cap held the session
+    // back, the client is not the one being quiet
+    if (session->state == SEND_DATA && session->window->lowest == session->window->current){
+        arm_timer(session);
+        return;
+    }
+
+    // The timed packet is lost or late, and waiting longer is the fix
+    session->timed_seq = -1;
+    rtt_backoff(&session->rtt);
+    if (session->state == SEND_DATA){
+        CongestionSignal signal;
+        make_signal(session, &signal, session->window->lowest, 0, -1);
+        congestion_on_timeout(&session->congestion, &signal);
+    }
+
+    if (++session->attempts >= SESSION_MAX_ATTEMPTS){
+        if (session->state == WAIT_EOF_ACK){
+            printf("EOF_ACK not received after %d attempts. Terminating.\n", SESSION_MAX_ATTEMPTS);
+        }else{
+            printf("Client timed out. Ending transfer.\n");
+        }
+        session->state = DONE;
+        return;
+    }
+
+    if (session->state == SEND_DATA){
+        printf("Resending from timeout:%d\n", session->window->current);
+        resend_packet(session, session->window->lowest, FLAG_RESENT_TIMEOUT);
+    }else if (session->state == WAIT_EOF_ACK){
+        printf("Timeout waiting for EOF_ACK\n");
+        send_eof(session);
+        printf("Sent EOF (Attempt %d/%d)\n", session->attempts + 1, SESSION_MAX_ATTEMPTS);
+    }
+    send_batch_flush(session->batch, session->socketNum, &session->client);
+    arm_timer(session);
+}
+
+/*Sends the tail loss probe: the last packet sent goes out again, the
+  EOF once the whole file is out. Whatever the client answers shows the
+  server which packets of the tail it is missing. The retransmit timeout
+  stays armed behind it*/
+static void session_probe(Session *session){
+    CircularBuffer *window = session->window;
+
+    session->probe_at = 0;
+    session->deadline = session->timeout_at;
+    if (session->state == WAIT_EOF_ACK){
+        printf("Tail loss probe, resending EOF\n");
+        send_eof(session);
+    }else if (session->state == SEND_DATA && window->lowest < window->current){
+        printf("Tail loss probe, resending packet #%d\n", window->current - 1);
+        resend_packet(session, window->current - 1, FLAG_RESENT_DATA);
+    }
+    send_batch_flush(session->batch, session->socketNum, &session->client);
+}
+
+/*True once the session's deadline or its paced send is due*/
+int session_timer_due(Session *session){
+    if (session->send_at_us > 0 && session->send_at_us <= rtt_now_us()){
+        return 1;
+    }
+    return session->deadline <= session_now_ms();
+}
+
+/*rtt_now_us() at which session_timer_due turns true: the timer
+  deadline or a held back paced send, whichever comes first*/
+long session_wake_us(Session *session){
+    long wake_us = session->deadline * 1000;
+
+    if (session->send_at_us > 0 && session->send_at_us < wake_us){
+        wake_us = session->send_at_us;
+    }
+    return wake_us;
+}
+
+/*Called when the deadline or the pace timer fired. Runs the tail loss
+  probe or the timeout if the deadline is what passed, then sends
+  whatever the window allows*/
+void session_timer(Session *session, RecvBatch *acks){
+    long now = session_now_ms();
+
+    if (session->send_at_us > 0 && session->send_at_us <= rtt_now_us()){
+        session->send_at_us = 0;
+    }
+    if (session->timeout_at <= now){
+        session_timeout(session);
+    }else if (session->probe_at > 0 && session->probe_at <= now){
+        session_probe(session);
+    }
+    if (session->state == SEND_DATA){
+        handle_send_data(session, acks);
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "buffer.h"
+#include "sendBatch.h"
+#include "recvBatch.h"
+#include "uringIO.h"
+#include "checksumIndex.h"
+#include "rtt.h"
+#include "congestion.h"
+#include "pacer.h"
+#include "fec.h"
+#include "chunkCache.h"
+
+// Timeouts in a row before the client is given up on
+#define SESSION_MAX_ATTEMPTS 10
+// read_file_to_buffer found no window memory under the cap
+#define SESSION_NO_MEMORY -2
+// Duplicate RRs for the lowest packet that resend it without a timeout
+#define SESSION_DUP_RRS 3
+// Shortest wait before a tail loss probe
+#define SESSION_PROBE_MIN_MS 5
+// Windows of the file read ahead of the send point by default
+#define SESSION_PREFETCH_DEPTH 2
+// Most bytes one read ahead hint asks for
+#define SESSION_PREFETCH_MAX_BYTES (64L * 1024 * 1024)
+
+typedef enum
+{
+    DONE,
+    FILENAME_ACK,
+    SEND_DATA,
+    WAIT_EOF_ACK
+} ServerState;
+
+/*Server wide settings picked on the command line*/
+typedef struct {
+    int emulate_errors;  // sendErr_init was given a non zero error rate
+    int use_uring;       // Event loops read and send through io_uring
+    int use_mmap;        // Send file data straight from a mapping of the file
+    int use_cksum_index; // Take payload checksums from the file's sidecar index
+    int index_in_background; // Build a missing sidecar on a helper thread, not in session_create
+    const CongestionOps *congestion; // Congestion control for every session
+    int pace_window;     // Pace window based controllers at cwnd per smoothed RTT
+    double pace_mbps;    // Cap on every session's sending rate, 0 for none
+    int prefetch_depth;  // Windows of the file read ahead of the send point, 0 for none
+    ChunkCache *chunk_cache; // File chunks shared by every session, NULL for none
+    int verbose;         // Trace every packet sent and acknowledged
+} ServerOptions;
+
+/*What the client asked for in its filename packet*/
+typedef struct {
+    int window_size;
+    int buffer_size;
+    char filename[MAX_FILENAME_SIZE + 1];
+    int transfer_class;  // TRANSFER_NORMAL or TRANSFER_BACKGROUND
+    int fec_data;        // Data packets per FEC block, 0 without FEC
+    int fec_parity;      // Parity packets per FEC block
+} TransferRequest;
+
+/*Everything one transfer needs, so a single process can run many.
+  The send batch may be shared by sessions that run on the same thread,
+  it is always flushed before a session function returns.*/
+typedef struct {
+    int socketNum;               // Socket used for this client only
+    struct sockaddr_in6 client;
+    CircularBuffer *window;
+    FILE *export_file;
+    SendBatch *batch;
+    ServerState state;
+    int attempts;                // Timeouts since the client was last heard from
+    long deadline;               // session_now_ms() when the timer fires, the earlier of the two below
+    long timeout_at;             // session_now_ms() of the retransmit timeout
+    long probe_at;               // session_now_ms() of the tail loss probe, 0 when none is armed
+    int dup_rrs;                 // RRs in a row repeating the lowest unacknowledged packet
+    RttEstimator rtt;            // Sets the retransmit timeout from RR round trips
+    int timed_seq;               // Data packet being timed for an RTT sample, -1 for none
+    long timed_at_us;            // rtt_now_us() when timed_seq was sent
+    CongestionControl congestion; // Caps the packets in flight below the receiver window
+    int peer_window;             // Receive window from the client's last RR, at most the window size
+    Pacer pacer;
+    long send_at_us;             // rtt_now_us() to resume a paced send, 0 when not waiting
+    long wake_us;                // session_wake_us() when an event loop last filed the session
+    int timer_slot;              // Position in that loop's timer heap, -1 when not in one
+    int pace_window;             // From ServerOptions
+    double pace_cap;             // ServerOptions pace_mbps in packets per second, 0 for none
+    UringIO *ring;               // Set when reads and sends go through io_uring
+    int eof_seq;                 // First sequence number past the file, -1 until a read finds it
+    int reads_inflight;          // io_uring reads not completed yet
+    int io_inflight;             // All io_uring requests not completed yet
+    uint8_t *map;                // Whole file mapped read only, NULL when reading with fread
+    size_t map_len;
+    CksumIndex *cksum_index;     // Payload sums for this buffer size, NULL without one
+    FecEncoder *fec;             // Parity for the client's FEC blocks, NULL without FEC
+    int prefetch_depth;          // From ServerOptions
+    int prefetched;              // First sequence number not read ahead yet
+    ChunkCache *cache;           // From ServerOptions, NULL for none or when mapped
+    ChunkFileId file_id;         // The export file's key in the cache
+    int verbose;                 // From ServerOptions
+} Session;
+
+FILE *process_filename_packet(SendBatch *batch, int socketNum, struct sockaddr_in6 *client, uint8_t *buffer, int dataLen, TransferRequest *request);
+
+Session *session_create(int socketNum, struct sockaddr_in6 *client, FILE *export_file, const TransferRequest *request, SendBatch *batch, const ServerOptions *options);
+void session_free(Session *session);
+
+void handle_send_data(Session *session, RecvBatch *acks);
+void session_readable(Session *session, RecvBatch *acks);
+void session_timeout(Session *session);
+int session_timer_due(Session *session);
+long session_wake_us(Session *session);
+void session_timer(Session *session, RecvBatch *acks);
+#ifdef USE_IO_URING
+void session_io_complete(Session *session, UringRequest *request, int result);
+#endif
+
+long session_now_ms(void);
+
+#endif
@@ -0,0 +1,287 @@
+/* Minimal io_uring wrapper on the raw system calls, only what the
+   server needs: file reads, UDP sends and an eventfd for completions.
+   Built when the Makefile defines USE_IO_URING. */
+
+#ifdef USE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "uringIO.h"
+#include "safeUtil.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params){
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/*Sets up the ring and maps its queues.
+  Returns NULL (after printing why) if the kernel refuses io_uring so
+  the caller can fall back to the blocking calls*/
+UringIO *uring_create(unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // Room for many windows of completions before anyone reaps them
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 8;
+
+    int ring_fd = sys_io_uring_setup(entries, &params);
+    if (ring_fd < 0){
+        perror("io_uring_setup");
+        return NULL;
+    }
+
+    UringIO *ring = (UringIO *)sCalloc(1, sizeof(UringIO));
+    ring->ring_fd = ring_fd;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (ring->cq_ring_size > ring->sq_ring_size){
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED){
+        perror("mmap io_uring sq");
+        exit(-1);
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_ring = ring->sq_ring;
+    }else{
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED){
+            perror("mmap io_uring cq");
+            exit(-1);
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        perror("mmap io_uring sqes");
+        exit(-1);
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_flags = (unsigned *)(sq + params.sq_off.flags);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    uint8_t *cq = (uint8_t *)ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->cq_entries = params.cq_entries;
+
+    // Completions wake the event loop through this eventfd
+    if ((ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+        perror("eventfd");
+        exit(-1);
+    }
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0){
+        perror("io_uring_register eventfd");
+        exit(-1);
+    }
+
+    ring->free_requests = NULL;
+    ring->inflight = 0;
+    return ring;
+}
+
+void uring_free(UringIO *ring){
+    while (ring->free_requests != NULL){
+        UringRequest *next = ring->free_requests->next;
+        free(ring->free_requests);
+        ring->free_requests = next;
+    }
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->event_fd);
+    close(ring->ring_fd);
+    free(ring);
+}
+
+/*Takes a request from the pool, growing it when empty*/
+UringRequest *uring_request_get(UringIO *ring, int op, void *owner, uint32_t seq_num){
+    UringRequest *request = ring->free_requests;
+
+    if (request != NULL){
+        ring->free_requests = request->next;
+    }else{
+        request = (UringRequest *)sCalloc(1, sizeof(UringRequest));
+    }
+
+    request->op = op;
+    request->owner = owner;
+    request->seq_num = seq_num;
+    request->next = NULL;
+    ring->inflight++;
+    return request;
+}
+
+void uring_request_put(UringIO *ring, UringRequest *request){
+    request->next = ring->free_requests;
+    ring->free_requests = request;
+    ring->inflight--;
+}
+
+/*True when completions more requests can be taken without the
+  completion queue overflowing. Every request in flight will post one
+  completion, and nothing else posts any*/
+int uring_room(const UringIO *ring, unsigned completions){
+    return ring->inflight + completions <= ring->cq_entries;
+}
+
+/*Returns the next free SQE, handing the queued ones to the kernel
+  first if the submission queue is full.
+  Returns NULL when the kernel won't take any right now*/
+static struct io_uring_sqe *next_sqe(UringIO *ring){
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_local_tail - head >= ring->sq_entries){
+        uring_submit(ring);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries){
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+/*Queues a pread of len bytes at offset into buf.
+  Returns 0 when the submission queue is full*/
+int uring_prep_read(UringIO *ring, UringRequest *request, int fd, void *buf, unsigned len, off_t offset){
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    if (sqe == NULL){
+        return 0;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+    return 1;
+}
+
+/*Queues a sendmsg of the first packet_len bytes of request->packet.
+  Returns 0 when the submission queue is full*/
+int uring_prep_send(UringIO *ring, UringRequest *request, int socketNum, struct sockaddr_in6 *client, int packet_len){
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    if (sqe == NULL){
+        return 0;
+    }
+
+    memcpy(&request->client, client, sizeof(struct sockaddr_in6));
+    request->iov.iov_base = request->packet;
+    request->iov.iov_len = packet_len;
+    memset(&request->msg, 0, sizeof(request->msg));
+    request->msg.msg_name = &request->client;
+    request->msg.msg_namelen = sizeof(struct sockaddr_in6);
+    request->msg.msg_iov = &request->iov;
+    request->msg.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socketNum;
+    sqe->addr = (uint64_t)(uintptr_t)&request->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+    return 1;
+}
+
+/*Hands every queued SQE to the kernel with one io_uring_enter call.
+  Returns the number submitted*/
+int uring_submit(UringIO *ring){
+    // The kernel moves sq_head as it consumes, anything past it is still ours
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned to_submit = ring->sq_local_tail - head;
+
+    if (to_submit == 0){
+        return 0;
+    }
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    int submitted;
+    while ((submitted = sys_io_uring_enter(ring->ring_fd, to_submit, 0, 0)) < 0){
+        if (errno == EINTR){
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY){
+            // Completion queue is backed up, the SQEs stay queued for later
+            return 0;
+        }
+        perror("io_uring_enter");
+        exit(-1);
+    }
+    return submitted;
+}
+
+/*Pops one completion. Returns 0 when there is none.
+  Completions the kernel could not fit in the queue are held on its
+  overflow list until an io_uring_enter with GETEVENTS moves them in*/
+int uring_next_completion(UringIO *ring, UringRequest **request, int *result){
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail && (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)){
+        if (sys_io_uring_enter(ring->ring_fd, 0, 0, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+            perror("io_uring_enter getevents");
+        }
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    if (head == tail){
+        return 0;
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *request = (UringRequest *)(uintptr_t)cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*Resets the eventfd after it woke the event loop*/
+void uring_clear_event(UringIO *ring){
+    uint64_t count;
+    if (read(ring->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+        perror("read eventfd");
+    }
+}
+
+#endif
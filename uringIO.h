@@ -0,0 +1,83 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "communication.h"
+
+// Submission queue depth of the ring
+#define URING_ENTRIES 256
+
+// What a request was submitted for
+#define URING_OP_READ 1
+#define URING_OP_SEND 2
+
+/*One read or send in flight. user_data of the SQE points here so the
+  completion can be routed back to its owner (a Session)*/
+typedef struct UringRequest {
+    int op;
+    void *owner;
+    uint32_t seq_num;
+    struct UringRequest *next;      // Free list link
+    struct msghdr msg;              // Sends only, must live until completion
+    struct iovec iov;
+    struct sockaddr_in6 client;
+    uint8_t packet[MAX_PDU];
+} UringRequest;
+
+/*A raw io_uring instance (no liburing) plus a pool of requests.
+  Completions are signalled on event_fd so the ring can sit in an
+  epoll set next to the sockets.*/
+typedef struct UringIO UringIO;
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+
+struct UringIO {
+    int ring_fd;
+    int event_fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *sq_flags;      // The kernel sets IORING_SQ_CQ_OVERFLOW here
+    unsigned sq_entries;
+    unsigned sq_local_tail;  // Tail including SQEs not handed over yet
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned cq_entries;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    UringRequest *free_requests;
+    unsigned inflight;       // Requests taken from the pool and not put back yet
+};
+
+UringIO *uring_create(unsigned entries);
+void uring_free(UringIO *ring);
+
+UringRequest *uring_request_get(UringIO *ring, int op, void *owner, uint32_t seq_num);
+void uring_request_put(UringIO *ring, UringRequest *request);
+int uring_room(const UringIO *ring, unsigned completions);
+
+int uring_prep_read(UringIO *ring, UringRequest *request, int fd, void *buf, unsigned len, off_t offset);
+int uring_prep_send(UringIO *ring, UringRequest *request, int socketNum, struct sockaddr_in6 *client, int packet_len);
+int uring_submit(UringIO *ring);
+int uring_next_completion(UringIO *ring, UringRequest **request, int *result);
+void uring_clear_event(UringIO *ring);
+
+#endif
+
+#endif